@@ -0,0 +1,67 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+// One instance per view, split screen squeezes each into its half
+uniform mat4 VP[2];
+uniform int views;
+uniform float time;
+
+// Block placement and current roll, set once when a roll starts
+uniform vec3 position;
+uniform vec3 pivot;        // moves the rolling edge to the origin
+uniform vec3 pivotBack;    // and back again after the rotation
+uniform vec3 rollAxis;
+uniform float rollAngle;   // radians reached at the end of the roll
+uniform float rollStart;
+uniform float rollDuration;
+
+// Death fall, rollStart/fallStart are in seconds since the level began
+uniform float fallStart;   // negative while the block is alive
+uniform float fallSpeed;   // units per second
+uniform vec3 fallAxis;
+uniform float fallSpin;    // radians per second, 0 for a straight drop
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+vec4 viewPosition (vec3 world)
+{
+    vec4 clip = VP[gl_InstanceID] * vec4(world, 1);
+    gl_ClipDistance[0] = clip.w + clip.x;
+    gl_ClipDistance[1] = clip.w - clip.x;
+    if (views > 1)
+        clip.x = 0.5 * clip.x + (gl_InstanceID == 0 ? -0.5 : 0.5) * clip.w;
+    return clip;
+}
+
+mat3 rotation (vec3 axis, float angle)
+{
+    float s = sin(angle);
+    float c = cos(angle);
+    vec3 t = axis * (1.0 - c);
+
+    return mat3(c + t.x*axis.x,          t.x*axis.y + s*axis.z,  t.x*axis.z - s*axis.y,
+                t.y*axis.x - s*axis.z,   c + t.y*axis.y,         t.y*axis.z + s*axis.x,
+                t.z*axis.x + s*axis.y,   t.z*axis.y - s*axis.x,  c + t.z*axis.z);
+}
+
+void main ()
+{
+    float progress = rollDuration > 0.0 ? clamp((time - rollStart) / rollDuration, 0.0, 1.0) : 0.0;
+    vec3 p = rotation(rollAxis, rollAngle * progress) * (vertexPosition + pivot);
+    vec3 offset = position;
+
+    if (fallStart >= 0.0) {
+        float t = max(time - fallStart, 0.0);
+        offset.z -= fallSpeed * t;
+        if (fallSpin != 0.0)
+            p = rotation(fallAxis, fallSpin * t) * p;
+    }
+
+    fragColor = vertexColor;
+
+    gl_Position = viewPosition(p + offset + pivotBack);
+}
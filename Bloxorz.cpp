@@ -4,10 +4,27 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#include "GLCapture.h"
+
 #define GLM_FORCE_RADIANS
 #define BITS 8
 #include <glm/glm.hpp>
@@ -16,14 +33,203 @@
 
 using namespace std;
 
+/* Every operator new in the process, so level loads and frames can show
+   they stayed off the general heap. Atomic since the audio threads
+   allocate too. */
+struct HeapStats {
+  atomic<long long> allocations;
+  atomic<long long> bytes;
+} heap_stats;
+
+void* operator new(size_t size) {
+  heap_stats.allocations.fetch_add(1, memory_order_relaxed);
+  heap_stats.bytes.fetch_add(size, memory_order_relaxed);
+  void* p = malloc(size ? size : 1);
+  if(!p)
+    throw bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+
+#define FRAME_ARENA_BYTES (4<<20)
+#define LEVEL_ARENA_BYTES (64<<20)
+
+/* Bump allocator over one block reserved at startup. Nothing is freed on
+   its own, reset() drops everything at once and rewind() returns to an
+   earlier mark. Only for trivially destructible data. */
+class LinearArena {
+  public:
+    const char* name;
+    char* base;
+    size_t capacity;
+    size_t used;
+    size_t peak;
+
+    void create(const char* name, size_t capacity) {
+      this->name=name;
+      this->base=(char*)malloc(capacity);
+      this->capacity=capacity;
+      this->used=0;
+      this->peak=0;
+      if(!this->base) {
+        fprintf(stderr, "Could not reserve %zu bytes for the %s arena\n", capacity, name);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    template <typename T>
+    T* alloc(size_t count) {
+      size_t start = (this->used + alignof(T) - 1) & ~(alignof(T) - 1);
+      if(start + count*sizeof(T) > this->capacity) {
+        fprintf(stderr, "%s arena out of memory: %zu of %zu bytes used, %zu more wanted\n",
+                this->name, this->used, this->capacity, count*sizeof(T));
+        exit(EXIT_FAILURE);
+      }
+      this->used = start + count*sizeof(T);
+      this->peak = max(this->peak, this->used);
+      return (T*)(this->base + start);
+    }
+
+    size_t mark() const {
+      return this->used;
+    }
+
+    void rewind(size_t mark) {
+      this->used=mark;
+    }
+
+    void reset() {
+      this->used=0;
+    }
+};
+
+// CPU side staging that lives until the end of the frame, and board
+// storage that lives until the level is unloaded, one per board
+LinearArena frame_arena;
+LinearArena level_arena;
+LinearArena prefetch_arena;
+
+enum MemoryCategory {
+  MEM_BOARD,
+  MEM_BLOCK,
+  MEM_HUD,
+  MEM_DEBUG,
+  MEM_CATEGORIES
+};
+
+const char* memory_category_names[MEM_CATEGORIES] = {"board", "block", "HUD", "debug"};
+
+/* Live GL objects (VAOs, static meshes, particle buffers) with the GPU
+   and host bytes they hold, per subsystem. Every create3DObject or
+   StaticMeshBuffer::add names the subsystem it belongs to. */
+class MemoryLedger {
+  public:
+    int objects[MEM_CATEGORIES];
+    long long gpu_bytes[MEM_CATEGORIES];
+    long long host_bytes[MEM_CATEGORIES];
+
+    void allocate(MemoryCategory category, long long gpu, long long host) {
+      this->objects[category]++;
+      this->gpu_bytes[category]+=gpu;
+      this->host_bytes[category]+=host;
+    }
+
+    void release(MemoryCategory category, long long gpu, long long host) {
+      this->objects[category]--;
+      this->gpu_bytes[category]-=gpu;
+      this->host_bytes[category]-=host;
+    }
+
+    /* The boards' tiles and chunks come from the level arenas, added here */
+    void report() {
+      printf("memory     objects        GPU       host\n");
+      for(int c=0;c<MEM_CATEGORIES;c++) {
+        long long host = this->host_bytes[c] + (c == MEM_BOARD ? level_arena.used + prefetch_arena.used : 0);
+        printf("%-8s %9d %9lldK %9lldK\n", memory_category_names[c], this->objects[c],
+               this->gpu_bytes[c]>>10, host>>10);
+      }
+    }
+} memory_ledger;
+
+void reportMemory() {
+  memory_ledger.report();
+}
+
+void recycleBuffer(GLuint buffer);
+void recycleVertexArray(GLuint vertex_array);
+
+/* Move-only owner of one GL object name. The name goes back to the
+   GLObjectPool when the handle is destroyed or reassigned, so objects
+   can't leak or be released twice. Reads convert to the plain GLuint. */
+template <void (*Recycle)(GLuint)>
+class GLHandle {
+  public:
+    GLuint name;
+
+    GLHandle() : name(0) {}
+    explicit GLHandle(GLuint name) : name(name) {}
+    GLHandle(GLHandle&& other) : name(other.name) {
+      other.name=0;
+    }
+    GLHandle& operator=(GLHandle&& other) {
+      if(this != &other) {
+        reset();
+        this->name=other.name;
+        other.name=0;
+      }
+      return *this;
+    }
+    GLHandle(const GLHandle&) = delete;
+    GLHandle& operator=(const GLHandle&) = delete;
+    ~GLHandle() {
+      reset();
+    }
+
+    void reset() {
+      if(this->name)
+        Recycle(this->name);
+      this->name=0;
+    }
+
+    operator GLuint() const {
+      return this->name;
+    }
+};
+
+typedef GLHandle<recycleBuffer> BufferHandle;
+typedef GLHandle<recycleVertexArray> VertexArrayHandle;
+
 struct VAO {
-    GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
+    VertexArrayHandle VertexArrayID;
+    BufferHandle VertexBuffer;
+    BufferHandle ColorBuffer;
+    BufferHandle DecalBuffer;
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+
+    MemoryCategory Category;
+    long long Bytes;      // in all of the VAO's buffers
 };
 typedef struct VAO VAO;
 
@@ -34,7 +240,33 @@ struct GLMatrices {
   GLuint MatrixID;
 } Matrices;
 
-GLuint programID;
+GLuint programID, blockProgramID, tileProgramID;
+
+/* Uniform handles of Block_GL.vert */
+struct BlockUniforms {
+  GLint VP;
+  GLint views;
+  GLint time;
+  GLint position;
+  GLint pivot;
+  GLint pivotBack;
+  GLint rollAxis;
+  GLint rollAngle;
+  GLint rollStart;
+  GLint rollDuration;
+  GLint fallStart;
+  GLint fallSpeed;
+  GLint fallAxis;
+  GLint fallSpin;
+} BlockShader;
+
+/* Uniform handles of Tile_GL.vert/Tile_GL.frag */
+struct TileUniforms {
+  GLint VP;
+  GLint views;
+  GLint tileSize;
+  GLint tileTop;
+} TileShader;
 
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
@@ -113,6 +345,54 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
   return ProgramID;
 }
 
+/* Loads a vertex shader whose outputs are captured with transform feedback
+   instead of being rasterized, varyings are interleaved in the given order */
+GLuint LoadFeedbackShader(const char * vertex_file_path, const char ** varyings, int varying_count) {
+
+  GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+
+  std::string VertexShaderCode;
+  std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
+  if(VertexShaderStream.is_open())
+  {
+    std::string Line = "";
+    while(getline(VertexShaderStream, Line))
+      VertexShaderCode += "\n" + Line;
+    VertexShaderStream.close();
+  }
+
+  GLint Result = GL_FALSE;
+  int InfoLogLength;
+
+  printf("Compiling shader : %s\n", vertex_file_path);
+  char const * VertexSourcePointer = VertexShaderCode.c_str();
+  glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
+  glCompileShader(VertexShaderID);
+
+  glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
+  glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+  std::vector<char> VertexShaderErrorMessage( max(InfoLogLength, int(1)) );
+  glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
+  fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
+
+  // The captured varyings have to be known before linking
+  fprintf(stdout, "Linking program\n");
+  GLuint ProgramID = glCreateProgram();
+  glAttachShader(ProgramID, VertexShaderID);
+  glTransformFeedbackVaryings(ProgramID, varying_count, varyings, GL_INTERLEAVED_ATTRIBS);
+  glLinkProgram(ProgramID);
+
+  glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+  glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+  std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
+  glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+  fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+
+  glDeleteShader(VertexShaderID);
+
+  return ProgramID;
+}
+
 static void error_callback(int error, const char* description)
 {
     fprintf(stderr, "Error: %s\n", description);
@@ -125,22 +405,264 @@ void quit(GLFWwindow *window)
     exit(EXIT_SUCCESS);
 }
 
+/* Optional driver features, read from the glad loader flags once the
+   context exists. Buffers and VAOs are created with direct state access
+   and immutable storage when both are there, bind-to-edit otherwise. */
+struct GLCaps {
+  bool direct_state_access;   // GL 4.5 or ARB_direct_state_access
+  bool buffer_storage;        // GL 4.4 or ARB_buffer_storage
+  bool immutable;             // both of the above, and not disabled by --no-dsa
+} gl_caps;
+
+bool allow_dsa = 1;
+
+void detectCaps() {
+  gl_caps.direct_state_access = GLAD_GL_VERSION_4_5 || GLAD_GL_ARB_direct_state_access;
+  gl_caps.buffer_storage = GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage;
+  gl_caps.immutable = allow_dsa && gl_caps.direct_state_access && gl_caps.buffer_storage;
+  printf("GL path: %s (direct state access %s, buffer storage %s)\n", gl_caps.immutable ? "DSA + persistent mapping" : "GL 3.3 bind-to-edit",
+         gl_caps.direct_state_access ? "yes" : "no", gl_caps.buffer_storage ? "yes" : "no");
+}
+
+#define UPLOAD_RING_BYTES (8<<20)
+#define UPLOAD_RING_SEGMENTS 4
+
+/* Persistently mapped staging memory for the immutable buffer path. Data
+   is written straight into the mapping and copied into its buffer on the
+   GPU, so the driver never keeps its own copy. A segment is fenced when
+   the ring moves past it and waited on before it is written again. */
+class UploadRing {
+  public:
+    GLuint buffer;
+    char* mapped;
+    int segment;
+    GLsizeiptr used;
+    GLsync fences[UPLOAD_RING_SEGMENTS];
+
+    void create() {
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glCreateBuffers(1, &this->buffer);
+      glNamedBufferStorage(this->buffer, UPLOAD_RING_BYTES, NULL, flags);
+      this->mapped = (char*)glMapNamedBufferRange(this->buffer, 0, UPLOAD_RING_BYTES, flags);
+      this->segment=0;
+      this->used=0;
+      for(int i=0;i<UPLOAD_RING_SEGMENTS;i++)
+        this->fences[i]=0;
+    }
+
+    /* Whether data of this size goes through the ring at all */
+    bool fits(GLsizeiptr size) {
+      return this->mapped && ((size+15)&~(GLsizeiptr)15) <= UPLOAD_RING_BYTES/UPLOAD_RING_SEGMENTS;
+    }
+
+    /* Copies data into the ring and returns its offset in this->buffer */
+    GLsizeiptr stage(const void* data, GLsizeiptr size) {
+      const GLsizeiptr segment_bytes = UPLOAD_RING_BYTES/UPLOAD_RING_SEGMENTS;
+      GLsizeiptr aligned = (size+15)&~(GLsizeiptr)15;
+      if(this->used + aligned > segment_bytes) {
+        this->fences[this->segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        this->segment = (this->segment+1)%UPLOAD_RING_SEGMENTS;
+        this->used = 0;
+        if(this->fences[this->segment]) {
+          glClientWaitSync(this->fences[this->segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+          glDeleteSync(this->fences[this->segment]);
+          this->fences[this->segment]=0;
+        }
+      }
+
+      GLsizeiptr offset = this->segment*segment_bytes + this->used;
+      memcpy(this->mapped+offset, data, size);
+      this->used += aligned;
+      return offset;
+    }
+
+    /* Returns a new immutable buffer holding size bytes of data */
+    GLuint upload(const void* data, GLsizeiptr size) {
+      GLuint target;
+      glCreateBuffers(1, &target);
+      if(!fits(size)) {
+        glNamedBufferStorage(target, size, data, 0);
+        return target;
+      }
+      GLsizeiptr offset = stage(data, size);
+      glNamedBufferStorage(target, size, NULL, 0);
+      glCopyNamedBufferSubData(this->buffer, target, offset, 0, size);
+      return target;
+    }
+
+    /* Overwrites the first size bytes of an immutable buffer. Copies are
+       allowed into storage without GL_DYNAMIC_STORAGE_BIT. */
+    void update(GLuint target, const void* data, GLsizeiptr size) {
+      if(!fits(size)) {
+        GLuint source;
+        glCreateBuffers(1, &source);
+        glNamedBufferStorage(source, size, data, 0);
+        glCopyNamedBufferSubData(source, target, 0, 0, size);
+        glDeleteBuffers(1, &source);
+        return;
+      }
+      glCopyNamedBufferSubData(this->buffer, target, stage(data, size), 0, size);
+    }
+};
+
+UploadRing upload_ring;
+
+#define GL_POOL_LIMIT 256
+
+/* Names of released buffers and vertex arrays, handed out again instead
+   of generating new ones. A recycled buffer has its storage orphaned and
+   a recycled vertex array its attributes disabled, so neither keeps GPU
+   memory or stale state alive. Immutable buffers cannot be respecified
+   and are deleted instead. */
+class GLObjectPool {
+  public:
+    vector<GLuint> buffers;
+    vector<GLuint> vertex_arrays;
+    vector<VAO*> records;  // VAO structs of destroyed objects
+    int live_buffers;
+    int live_vertex_arrays;
+    int rewrites;         // buffers updated in place instead of recreated
+
+    // Full size up front so recycling never reaches the heap, and the
+    // first GL_POOL_LIMIT records don't either
+    void create() {
+      this->buffers.reserve(GL_POOL_LIMIT);
+      this->vertex_arrays.reserve(GL_POOL_LIMIT);
+      this->records.reserve(GL_POOL_LIMIT);
+      for(int i=0;i<GL_POOL_LIMIT;i++)
+        this->records.push_back(new VAO);
+    }
+
+    VAO* record() {
+      if(this->records.empty())
+        return new VAO;
+      VAO* vao = this->records.back();
+      this->records.pop_back();
+      return vao;
+    }
+
+    /* The record's handles must be released already */
+    void recycleRecord(VAO* vao) {
+      if((int)this->records.size() >= GL_POOL_LIMIT)
+        delete vao;
+      else
+        this->records.push_back(vao);
+    }
+
+    GLuint buffer() {
+      GLuint name;
+      this->live_buffers++;
+      if(!this->buffers.empty()) {
+        name=this->buffers.back();
+        this->buffers.pop_back();
+        return name;
+      }
+      glGenBuffers(1, &name);
+      return name;
+    }
+
+    GLuint vertexArray() {
+      GLuint name;
+      this->live_vertex_arrays++;
+      if(!this->vertex_arrays.empty()) {
+        name=this->vertex_arrays.back();
+        this->vertex_arrays.pop_back();
+        return name;
+      }
+      if(gl_caps.immutable)
+        glCreateVertexArrays(1, &name);
+      else
+        glGenVertexArrays(1, &name);
+      return name;
+    }
+
+    /* Takes ownership of a buffer created elsewhere (the upload ring) */
+    GLuint adopt(GLuint buffer) {
+      this->live_buffers++;
+      return buffer;
+    }
+
+    void recycle(GLuint buffer) {
+      this->live_buffers--;
+      if(gl_caps.immutable || (int)this->buffers.size() >= GL_POOL_LIMIT) {
+        glDeleteBuffers(1, &buffer);
+        return;
+      }
+      glBindBuffer(GL_ARRAY_BUFFER, buffer);
+      glBufferData(GL_ARRAY_BUFFER, 0, NULL, GL_STATIC_DRAW);
+      this->buffers.push_back(buffer);
+    }
+
+    void recycleArray(GLuint vertex_array) {
+      this->live_vertex_arrays--;
+      if((int)this->vertex_arrays.size() >= GL_POOL_LIMIT) {
+        glDeleteVertexArrays(1, &vertex_array);
+        return;
+      }
+      for(GLuint attribute=0;attribute<3;attribute++) {
+        if(gl_caps.immutable)
+          glDisableVertexArrayAttrib(vertex_array, attribute);
+        else {
+          glBindVertexArray(vertex_array);
+          glDisableVertexAttribArray(attribute);
+        }
+      }
+      this->vertex_arrays.push_back(vertex_array);
+    }
+};
+
+GLObjectPool gl_objects;
+GLuint bound_vertex_array;
+
+void recycleBuffer(GLuint buffer) {
+  gl_objects.recycle(buffer);
+}
+
+void recycleVertexArray(GLuint vertex_array) {
+  gl_objects.recycleArray(vertex_array);
+  // The legacy path had to bind it to disable the attributes
+  if(!gl_caps.immutable)
+    bound_vertex_array = vertex_array;
+}
+
+/* Attaches a tightly packed buffer to one attribute of a DSA created VAO */
+void attachVertexBuffer (GLuint vertex_array, GLuint attribute, GLuint buffer, GLint size, GLenum type, GLboolean normalized, GLsizei stride)
+{
+    glVertexArrayVertexBuffer(vertex_array, attribute, buffer, 0, stride);
+    glVertexArrayAttribFormat(vertex_array, attribute, size, type, normalized, 0);
+    glVertexArrayAttribBinding(vertex_array, attribute, attribute);
+    glEnableVertexArrayAttrib(vertex_array, attribute);
+}
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/* Generate VAO, VBOs and return VAO handle, accounted to category */
+struct VAO* create3DObject (MemoryCategory category, GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
-    struct VAO* vao = new struct VAO;
+    struct VAO* vao = gl_objects.record();
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->Category = category;
+    vao->Bytes = 2*3*numVertices*sizeof(GLfloat);
+    memory_ledger.allocate(category, vao->Bytes, sizeof(VAO));
+
+    // Immutable buffers through the mapped ring, nothing gets bound
+    if(gl_caps.immutable) {
+      vao->VertexArrayID = VertexArrayHandle(gl_objects.vertexArray());
+      vao->VertexBuffer = BufferHandle(gl_objects.adopt(upload_ring.upload(vertex_buffer_data, 3*numVertices*sizeof(GLfloat))));
+      vao->ColorBuffer = BufferHandle(gl_objects.adopt(upload_ring.upload(color_buffer_data, 3*numVertices*sizeof(GLfloat))));
+      attachVertexBuffer(vao->VertexArrayID, 0, vao->VertexBuffer, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat));
+      attachVertexBuffer(vao->VertexArrayID, 1, vao->ColorBuffer, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat));
+      return vao;
+    }
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
-    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+    vao->VertexArrayID = VertexArrayHandle(gl_objects.vertexArray()); // VAO
+    vao->VertexBuffer = BufferHandle(gl_objects.buffer()); // VBO - vertices
+    vao->ColorBuffer = BufferHandle(gl_objects.buffer());  // VBO - colors
 
     glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    bound_vertex_array = vao->VertexArrayID;
     glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
@@ -167,26 +689,110 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 }
 
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+struct VAO* create3DObject (MemoryCategory category, GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+    const size_t staging_mark = frame_arena.mark();
+    GLfloat* color_buffer_data = frame_arena.alloc<GLfloat>(3*numVertices);
     for (int i=0; i<numVertices; i++) {
         color_buffer_data [3*i] = red;
         color_buffer_data [3*i + 1] = green;
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    struct VAO* vao = create3DObject(category, primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    frame_arena.rewind(staging_mark);
+    return vao;
+}
+
+/* Adds the per-vertex switch flag read by Tile_GL.frag as attribute 2 */
+void addDecalBuffer (struct VAO* vao, const GLubyte* decal_buffer_data)
+{
+    vao->Bytes += vao->NumVertices*sizeof(GLubyte);
+    memory_ledger.gpu_bytes[vao->Category] += vao->NumVertices*sizeof(GLubyte);
+    if(gl_caps.immutable) {
+      vao->DecalBuffer = BufferHandle(gl_objects.adopt(upload_ring.upload(decal_buffer_data, vao->NumVertices*sizeof(GLubyte))));
+      attachVertexBuffer(vao->VertexArrayID, 2, vao->DecalBuffer, 1, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GLubyte));
+      return;
+    }
+
+    vao->DecalBuffer = BufferHandle(gl_objects.buffer());
+    glBindVertexArray (vao->VertexArrayID);
+    bound_vertex_array = vao->VertexArrayID;
+    glBindBuffer (GL_ARRAY_BUFFER, vao->DecalBuffer);
+    glBufferData (GL_ARRAY_BUFFER, vao->NumVertices*sizeof(GLubyte), decal_buffer_data, GL_STATIC_DRAW);
+    glVertexAttribPointer(
+                          2,                  // attribute 2. Switch flag
+                          1,                  // size
+                          GL_UNSIGNED_BYTE,   // type
+                          GL_TRUE,            // normalized?
+                          0,                  // stride
+                          (void*)0            // array buffer offset
+                          );
+}
+
+
+/* Gives a VAO made by create3DObject and addDecalBuffer contents of a
+   different size. The VAO and its record stay, the legacy path even keeps
+   the buffer names. */
+void respecify3DObject (struct VAO* vao, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, const GLubyte* decal_buffer_data)
+{
+    long long bytes = 2*3*numVertices*sizeof(GLfloat) + numVertices*sizeof(GLubyte);
+    memory_ledger.gpu_bytes[vao->Category] += bytes - vao->Bytes;
+    vao->Bytes = bytes;
+    vao->NumVertices = numVertices;
+
+    // Immutable storage cannot grow or shrink, new buffers replace the old
+    if(gl_caps.immutable) {
+      vao->VertexBuffer = BufferHandle(gl_objects.adopt(upload_ring.upload(vertex_buffer_data, 3*numVertices*sizeof(GLfloat))));
+      vao->ColorBuffer = BufferHandle(gl_objects.adopt(upload_ring.upload(color_buffer_data, 3*numVertices*sizeof(GLfloat))));
+      vao->DecalBuffer = BufferHandle(gl_objects.adopt(upload_ring.upload(decal_buffer_data, numVertices*sizeof(GLubyte))));
+      glVertexArrayVertexBuffer(vao->VertexArrayID, 0, vao->VertexBuffer, 0, 3*sizeof(GLfloat));
+      glVertexArrayVertexBuffer(vao->VertexArrayID, 1, vao->ColorBuffer, 0, 3*sizeof(GLfloat));
+      glVertexArrayVertexBuffer(vao->VertexArrayID, 2, vao->DecalBuffer, 0, sizeof(GLubyte));
+      return;
+    }
+
+    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW);
+    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer);
+    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);
+    glBindBuffer (GL_ARRAY_BUFFER, vao->DecalBuffer);
+    glBufferData (GL_ARRAY_BUFFER, numVertices*sizeof(GLubyte), decal_buffer_data, GL_STATIC_DRAW);
+}
+
+/* Returns the VAO's GL objects to the pool and its record for reuse */
+void destroy3DObject (struct VAO* vao)
+{
+    memory_ledger.release(vao->Category, vao->Bytes, sizeof(VAO));
+    vao->VertexArrayID.reset();
+    vao->VertexBuffer.reset();
+    vao->ColorBuffer.reset();
+    vao->DecalBuffer.reset();
+    gl_objects.recycleRecord(vao);
+}
+
+/* Rewrites the data of a buffer made by create3DObject or addDecalBuffer,
+   the size must stay the same */
+void updateVertexBuffer (GLuint buffer, const void* data, GLsizeiptr size)
+{
+    gl_objects.rewrites++;
+    if(gl_caps.immutable) {
+      upload_ring.update(buffer, data, size);
+      return;
+    }
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+    glBufferSubData (GL_ARRAY_BUFFER, 0, size, data);
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Render the VBOs handled by VAO, once per view in split screen */
+void draw3DObject (struct VAO* vao, int instances=1)
 {
     // Change the Fill Mode for this object
     glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
 
     // Bind the VAO to use
     glBindVertexArray (vao->VertexArrayID);
+    bound_vertex_array = vao->VertexArrayID;
 
     // Enable Vertex Attribute 0 - 3d Vertices
     glEnableVertexAttribArray(0);
@@ -198,8 +804,119 @@ void draw3DObject (struct VAO* vao)
     // Bind the VBO to use
     glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
 
+    // Enable Vertex Attribute 2 - Switch flag, only board chunks have one
+    if(vao->DecalBuffer)
+      glEnableVertexAttribArray(2);
+
     // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, instances); // Starting from vertex 0; 3 vertices total -> 1 triangle
+}
+
+/* A mesh suballocated from the StaticMeshBuffer */
+struct StaticMesh {
+    GLenum PrimitiveMode;
+    GLenum FillMode;
+    GLint BaseVertex;
+    GLsizei FirstIndex;
+    GLsizei NumIndices;
+};
+
+/* Every mesh that never changes after startup lives in one interleaved
+   vertex buffer (x, y, z, r, g, b) and one index buffer behind a single
+   VAO, and is drawn with a base-vertex offset. Meshes are added while
+   staging on the CPU and uploaded together by upload(). */
+class StaticMeshBuffer {
+  public:
+    GLuint VertexArrayID;
+    GLuint VertexBuffer;
+    GLuint IndexBuffer;
+    vector<GLfloat> vertices;
+    vector<GLushort> indices;
+
+    /* Identical vertices within a mesh are shared through the index buffer */
+    StaticMesh add(MemoryCategory category, GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL) {
+      StaticMesh mesh;
+      int i, j, k;
+
+      mesh.PrimitiveMode = primitive_mode;
+      mesh.FillMode = fill_mode;
+      mesh.BaseVertex = this->vertices.size()/6;
+      mesh.FirstIndex = this->indices.size();
+      mesh.NumIndices = numVertices;
+
+      for(i=0;i<numVertices;i++) {
+        GLfloat vertex[6] = {vertex_buffer_data[3*i], vertex_buffer_data[3*i+1], vertex_buffer_data[3*i+2],
+                             color_buffer_data[3*i], color_buffer_data[3*i+1], color_buffer_data[3*i+2]};
+        int count = this->vertices.size()/6 - mesh.BaseVertex;
+        for(j=0;j<count;j++) {
+          for(k=0;k<6 && this->vertices[6*(mesh.BaseVertex+j)+k]==vertex[k];k++);
+          if(k==6)
+            break;
+        }
+        if(j==count)
+          this->vertices.insert(this->vertices.end(), vertex, vertex+6);
+        this->indices.push_back(j);
+      }
+      // Its share of the two buffers, they live as long as the process
+      memory_ledger.allocate(category, (this->vertices.size()-6*mesh.BaseVertex)*sizeof(GLfloat) + numVertices*sizeof(GLushort), 0);
+      return mesh;
+    }
+
+    void upload() {
+      if(gl_caps.immutable) {
+        glCreateVertexArrays(1, &this->VertexArrayID);
+        this->VertexBuffer = upload_ring.upload(this->vertices.data(), this->vertices.size()*sizeof(GLfloat));
+        this->IndexBuffer = upload_ring.upload(this->indices.data(), this->indices.size()*sizeof(GLushort));
+        glVertexArrayVertexBuffer(this->VertexArrayID, 0, this->VertexBuffer, 0, 6*sizeof(GLfloat));
+        glVertexArrayAttribFormat(this->VertexArrayID, 0, 3, GL_FLOAT, GL_FALSE, 0);
+        glVertexArrayAttribFormat(this->VertexArrayID, 1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat));
+        glVertexArrayAttribBinding(this->VertexArrayID, 0, 0);
+        glVertexArrayAttribBinding(this->VertexArrayID, 1, 0);
+        glEnableVertexArrayAttrib(this->VertexArrayID, 0);
+        glEnableVertexArrayAttrib(this->VertexArrayID, 1);
+        glVertexArrayElementBuffer(this->VertexArrayID, this->IndexBuffer);
+        vector<GLfloat>().swap(this->vertices);
+        vector<GLushort>().swap(this->indices);
+        return;
+      }
+
+      glGenVertexArrays(1, &this->VertexArrayID);
+      glGenBuffers(1, &this->VertexBuffer);
+      glGenBuffers(1, &this->IndexBuffer);
+
+      glBindVertexArray (this->VertexArrayID);
+      glBindBuffer (GL_ARRAY_BUFFER, this->VertexBuffer);
+      glBufferData (GL_ARRAY_BUFFER, this->vertices.size()*sizeof(GLfloat), this->vertices.data(), GL_STATIC_DRAW);
+      glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, this->IndexBuffer);
+      glBufferData (GL_ELEMENT_ARRAY_BUFFER, this->indices.size()*sizeof(GLushort), this->indices.data(), GL_STATIC_DRAW);
+
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), (void*)0);
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), (void*)(3*sizeof(GLfloat)));
+      bound_vertex_array = this->VertexArrayID;
+
+      // The CPU copy is not needed anymore
+      vector<GLfloat>().swap(this->vertices);
+      vector<GLushort>().swap(this->indices);
+    }
+};
+
+StaticMeshBuffer static_meshes;
+
+/* Render a mesh from the StaticMeshBuffer, only binds the shared VAO when
+   something else (a board chunk) was drawn in between */
+void drawStaticMesh (const StaticMesh* mesh, int instances=1)
+{
+    glPolygonMode (GL_FRONT_AND_BACK, mesh->FillMode);
+
+    if(bound_vertex_array != static_meshes.VertexArrayID) {
+      glBindVertexArray (static_meshes.VertexArrayID);
+      bound_vertex_array = static_meshes.VertexArrayID;
+    }
+
+    glDrawElementsInstancedBaseVertex(mesh->PrimitiveMode, mesh->NumIndices, GL_UNSIGNED_SHORT,
+                                      (void*)(mesh->FirstIndex*sizeof(GLushort)), instances, mesh->BaseVertex);
 }
 
 /**************************
@@ -248,273 +965,585 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 }
 
 
-/* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height)
-{
-    int fbwidth=width, fbheight=height;
-    /* With Retina display on Mac OS X, GLFW's FramebufferSize
-     is different from WindowSize */
-    //glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+enum CameraMode { TOP_VIEW, TOWER_VIEW, LEVEL_VIEW, BLOCK_VIEW, FRONT_VIEW };
 
-  // set the projection matrix as perspective
-  /* glMatrixMode (GL_PROJECTION);
-     glLoadIdentity ();
-     gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
-  // Store the projection matrix in a variable for future use
-}
+/* Owns the active view and caches the view/projection matrices.
+   Setters only mark the camera dirty when their input actually changes,
+   so getVP() is a plain copy on frames where nothing moved. */
+class Camera {
+  public:
+    CameraMode mode;
+    float follow_x;
+    float follow_y;
+    bool follow_axis_x;
+    float target_x;
+    float target_y;
+    float zoom;
+    glm::vec3 eye;
+    int viewport_width;
+    int viewport_height;
+    bool view_dirty;
+    bool projection_dirty;
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 VP;
+    glm::mat4 hud_VP;
+
+    void create(CameraMode mode, int width, int height) {
+      this->mode=mode;
+      this->follow_x=0;
+      this->follow_y=0;
+      this->follow_axis_x=0;
+      this->target_x=0.4*5;
+      this->target_y=0.4*5;
+      this->zoom=0;
+      this->viewport_width=width;
+      this->viewport_height=height;
+      this->view_dirty=1;
+      this->projection_dirty=1;
+
+      // The HUD camera never moves, build it once
+      this->hud_VP = glm::ortho(-4.0f, 4.0f, -0.7f, 0.7f, 0.1f, 500.0f) * glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
+    }
 
-VAO *triangle, *rectangle;
+    void setMode(CameraMode mode) {
+      if(this->mode != mode) {
+        this->mode=mode;
+        this->view_dirty=1;
+      }
+    }
 
-// Creates the triangle object used in this sample code
-void createTriangle ()
-{
-  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+    /* Block position and facing, used by block_view and front_view */
+    void setFollow(float x, float y, bool axis_x) {
+      if(this->follow_x != x || this->follow_y != y || this->follow_axis_x != axis_x) {
+        this->follow_x=x;
+        this->follow_y=y;
+        this->follow_axis_x=axis_x;
+        if(this->mode == BLOCK_VIEW || this->mode == FRONT_VIEW)
+          this->view_dirty=1;
+      }
+    }
 
-  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-  static const GLfloat vertex_buffer_data [] = {
-    0, 1,0, // vertex 0
-    -1,-1,0, // vertex 1
-    1,-1,0, // vertex 2
-  };
+    /* Mouse driven look-at point and scroll zoom, used by top_view */
+    void setTarget(float x, float y, float zoom) {
+      if(this->target_x != x || this->target_y != y || this->zoom != zoom) {
+        this->target_x=x;
+        this->target_y=y;
+        this->zoom=zoom;
+        if(this->mode == TOP_VIEW)
+          this->view_dirty=1;
+      }
+    }
 
-  static const GLfloat color_buffer_data [] = {
-    1,0,0, // color 0
-    0,1,0, // color 1
-    0,0,1, // color 2
-  };
+    void setViewport(int width, int height) {
+      if(this->viewport_width != width || this->viewport_height != height) {
+        this->viewport_width=width;
+        this->viewport_height=height;
+        this->projection_dirty=1;
+      }
+    }
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
-}
+    const glm::mat4& getVP() {
+      if(this->projection_dirty) {
+        this->projection = glm::perspective ((GLfloat) (M_PI/2), (GLfloat) this->viewport_width / (GLfloat) this->viewport_height, 0.1f, 500.0f);
+      }
+      if(this->view_dirty) {
+        this->view = computeView();
+      }
+      if(this->projection_dirty || this->view_dirty) {
+        this->VP = this->projection * this->view;
+        this->projection_dirty=0;
+        this->view_dirty=0;
+      }
+      return this->VP;
+    }
 
-// Creates the rectangle object used in this sample code
-void createSwitch (VAO** line_1, VAO** line_2, float width, float length, float height)
-{
-  float reduce=0.04;
-  height+=0.0009;
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data_1 [] = {
-    width-reduce,length,height, // vertex 1
-    width,length-reduce,height, // vertex 2
-    -width+reduce,-length,height, // vertex 3
-
-    -width+reduce, -length,height, // vertex 3
-    -width, -length+reduce,height, // vertex 4
-    width-reduce,length,height, // vertex 1
-  };
+    glm::mat4 computeView() {
+      float x=this->follow_x, y=this->follow_y;
+
+      switch(this->mode) {
+        case TOP_VIEW:
+          this->eye = glm::vec3(0.4*5, 0.4*5, 5+this->zoom);
+          return glm::lookAt(this->eye, glm::vec3(this->target_x, this->target_y, 0), glm::vec3(0, 1, 0));
+        case TOWER_VIEW:
+          this->eye = glm::vec3(-1, -1, 4);
+          return glm::lookAt(this->eye, glm::vec3(0.4*5, 0.4*5, 0), glm::vec3(1, 1, 0));
+        case LEVEL_VIEW:
+          this->eye = glm::vec3(0.4*5, -0.4*5, 2);
+          return glm::lookAt(this->eye, glm::vec3(0.4*5, 0.4*5, 0), glm::vec3(0, 1, 0));
+        case BLOCK_VIEW:
+          if(this->follow_axis_x) {
+            this->eye = glm::vec3(x-1.5, y, 3.5);
+            return glm::lookAt(this->eye, glm::vec3(x+0.4*10, y, 1), glm::vec3(0, 0, 1));
+          }
+          this->eye = glm::vec3(x, y-1.5, 3.5);
+          return glm::lookAt(this->eye, glm::vec3(x, y+0.4*10, 1), glm::vec3(0, 0, 1));
+        case FRONT_VIEW:
+        default:
+          if(this->follow_axis_x) {
+            this->eye = glm::vec3(x+0.4, y, 1.5);
+            return glm::lookAt(this->eye, glm::vec3(x+0.4*5, y, 0), glm::vec3(0, 0, 1));
+          }
+          this->eye = glm::vec3(x, y+0.4, 1.5);
+          return glm::lookAt(this->eye, glm::vec3(x, y+0.4*5, 0), glm::vec3(0, 0, 1));
+      }
+    }
+
+    /* Identifies the eye position for draw order caching. The fixed views
+       (and the top view, whose eye only moves along z above the board
+       center) need one order each, the follow views one per block cell. */
+    long long orderKey() {
+      long long key = this->mode;
+      if(this->mode == BLOCK_VIEW || this->mode == FRONT_VIEW) {
+        key |= (long long)this->follow_axis_x << 4;
+        key |= (long long)(lround(this->follow_x/0.4) & 0xffff) << 8;
+        key |= (long long)(lround(this->follow_y/0.4) & 0xffff) << 24;
+      }
+      return key;
+    }
+};
 
-  static const GLfloat color_buffer_data_1 [] = {
-    1,1,1, // color 1
-    1,1,1, // color 2
-    1,1,1, // color 3
+Camera camera;
+
+#define MAX_VIEWS 2
+
+/* Every camera the scene is drawn for. Each draw is instanced once per
+   view and the vertex shaders pick VP[gl_InstanceID], so split screen
+   walks the scene a single time for both players. */
+struct Views {
+  int count;
+  glm::mat4 VP[MAX_VIEWS];
+  glm::vec3 eye[MAX_VIEWS];
+  long long order_key[MAX_VIEWS];   // Camera::orderKey() of each view
+  int screen_width;     // board area, shared by all views
+  int screen_height;
+} views = {1};
+
+void uploadViews(GLint VP, GLint count) {
+  glUniformMatrix4fv(VP, views.count, GL_FALSE, &views.VP[0][0][0]);
+  glUniform1i(count, views.count);
+}
 
-    1,1,1, // color 3
-    1,1,1, // color 4
-    1,1,1  // color 1
-  };
+/* Translation-only object transforms kept as a structure of arrays.
+   compute() turns them into one contiguous array of MVPs in a single
+   pass: for a pure translation the MVP is VP with its last column
+   replaced by VP * (x, y, z, 1), so only that column is evaluated. */
+class TransformBatch {
+  public:
+    vector<float> x;
+    vector<float> y;
+    vector<float> z;
+    vector<glm::mat4> MVP;
+    glm::mat4 last_VP;
+    bool dirty;
+
+    int add(float x, float y, float z) {
+      this->x.push_back(x);
+      this->y.push_back(y);
+      this->z.push_back(z);
+      this->dirty=1;
+      return this->x.size()-1;
+    }
 
-  static const GLfloat vertex_buffer_data_2 [] = {
-    -width+reduce,length,height, // vertex 1
-    -width,length-reduce,height, // vertex 2
-    width-reduce,-length,height, // vertex 3
+    void set(int index, float x, float y, float z) {
+      if(this->x[index] != x || this->y[index] != y || this->z[index] != z) {
+        this->x[index]=x;
+        this->y[index]=y;
+        this->z[index]=z;
+        this->dirty=1;
+      }
+    }
 
-    width-reduce, -length,height, // vertex 3
-    width, -width+reduce,height, // vertex 4
-    -width+reduce,length,height, // vertex 1
-  };
+    /* Recomputes only if an object moved or the camera changed */
+    void compute(const glm::mat4& VP) {
+      if(!this->dirty && memcmp(&this->last_VP[0][0], &VP[0][0], sizeof(glm::mat4)) == 0)
+        return;
+      this->last_VP=VP;
+      this->dirty=0;
+
+      int i, count=this->x.size();
+      this->MVP.resize(count);
+      const float *px=this->x.data(), *py=this->y.data(), *pz=this->z.data();
+#ifdef __SSE__
+      __m128 c0=_mm_loadu_ps(&VP[0][0]);
+      __m128 c1=_mm_loadu_ps(&VP[1][0]);
+      __m128 c2=_mm_loadu_ps(&VP[2][0]);
+      __m128 c3=_mm_loadu_ps(&VP[3][0]);
+      float* out=&this->MVP[0][0][0];
+      for(i=0;i<count;i++, out+=16) {
+        __m128 t=_mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(px[i])), _mm_mul_ps(c1, _mm_set1_ps(py[i]))),
+                            _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(pz[i])), c3));
+        _mm_storeu_ps(out, c0);
+        _mm_storeu_ps(out+4, c1);
+        _mm_storeu_ps(out+8, c2);
+        _mm_storeu_ps(out+12, t);
+      }
+#else
+      for(i=0;i<count;i++) {
+        this->MVP[i]=VP;
+        this->MVP[i][3]=VP[0]*px[i] + VP[1]*py[i] + VP[2]*pz[i] + VP[3];
+      }
+#endif
+    }
+};
+
+TransformBatch hud_transforms;
+
+// Board chunks drawn front-to-back, see Board::drawOrder()
+bool sort_front_to_back = 1;
+
+/* Counts board fragments that reach the fragment shader and those that
+   pass the depth test. Fragments the early depth test throws away never
+   show up as shaded, so front-to-back ordering lowers the shaded count. */
+struct OverdrawStats {
+  GLuint shaded_query;
+  GLuint passed_query;
+  bool enabled;
+  bool pending;
+  bool has_pipeline_stats;
+  GLuint64 shaded;
+  GLuint64 passed;
+  int frames;
+  int triangles;        // board triangles submitted last frame
+  double submit_us;     // CPU time spent issuing the board, summed
+  int submits;
+} overdraw;
+
+bool record_board_draws = 1;
+
+void beginOverdrawQuery() {
+  if(!overdraw.enabled || overdraw.pending)
+    return;
+  if(!overdraw.passed_query) {
+    overdraw.has_pipeline_stats = GLAD_GL_ARB_pipeline_statistics_query;
+    glGenQueries(1, &overdraw.passed_query);
+    memory_ledger.allocate(MEM_DEBUG, 0, 0);
+    if(overdraw.has_pipeline_stats) {
+      glGenQueries(1, &overdraw.shaded_query);
+      memory_ledger.allocate(MEM_DEBUG, 0, 0);
+    }
+  }
+  glBeginQuery(GL_SAMPLES_PASSED, overdraw.passed_query);
+  if(overdraw.has_pipeline_stats)
+    glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, overdraw.shaded_query);
+}
+
+void endOverdrawQuery() {
+  if(!overdraw.enabled)
+    return;
+  if(!overdraw.pending) {
+    glEndQuery(GL_SAMPLES_PASSED);
+    if(overdraw.has_pipeline_stats)
+      glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+    overdraw.pending=1;
+    return;
+  }
+
+  // Results are read back a frame or more later to avoid stalling
+  GLint available=0;
+  glGetQueryObjectiv(overdraw.passed_query, GL_QUERY_RESULT_AVAILABLE, &available);
+  if(!available)
+    return;
+  GLuint64 value=0;
+  glGetQueryObjectui64v(overdraw.passed_query, GL_QUERY_RESULT, &value);
+  overdraw.passed+=value;
+  if(overdraw.has_pipeline_stats) {
+    glGetQueryObjectui64v(overdraw.shaded_query, GL_QUERY_RESULT, &value);
+    overdraw.shaded+=value;
+  }
+  overdraw.frames++;
+  overdraw.pending=0;
+}
+
+/* Printed once a second while the report is on (R key) */
+void reportOverdraw() {
+  if(!overdraw.enabled || !overdraw.frames)
+    return;
+  printf("board: %d triangles\n", overdraw.triangles);
+  if(overdraw.has_pipeline_stats)
+    printf("board (%s): %llu fragments shaded, %llu passed depth per frame, %llu rejected late\n",
+           sort_front_to_back ? "front-to-back" : "array order",
+           (unsigned long long)(overdraw.shaded/overdraw.frames), (unsigned long long)(overdraw.passed/overdraw.frames),
+           (unsigned long long)((overdraw.shaded-overdraw.passed)/overdraw.frames));
+  else
+    printf("board (%s): %llu samples passed depth per frame\n",
+           sort_front_to_back ? "front-to-back" : "array order", (unsigned long long)(overdraw.passed/overdraw.frames));
+  if(overdraw.submits)
+    printf("board (%s): %.1f us CPU per frame to submit\n",
+           record_board_draws ? "recorded" : "rebuilt", overdraw.submit_us/overdraw.submits);
+  printf("gl objects: %d buffers, %d vertex arrays live, %d and %d pooled, %d buffers rewritten in place\n",
+         gl_objects.live_buffers, gl_objects.live_vertex_arrays,
+         (int)gl_objects.buffers.size(), (int)gl_objects.vertex_arrays.size(), gl_objects.rewrites);
+  overdraw.shaded=0;
+  overdraw.passed=0;
+  overdraw.frames=0;
+  overdraw.submit_us=0;
+  overdraw.submits=0;
+}
 
-  static const GLfloat color_buffer_data_2 [] = {
-    1,1,1, // color 1
-    1,1,1, // color 2
-    1,1,1, // color 3
+/* Compares the per-object glm::translate/VP*model chain against
+   TransformBatch for a few object counts. Run with ./sample2D --bench */
+void benchTransforms() {
+  int counts[3] = {100, 10000, 100000};
+  int c, i, rep, reps;
+  glm::mat4 VP = glm::perspective ((GLfloat) (M_PI/2), 800.0f/480.0f, 0.1f, 500.0f) * glm::lookAt(glm::vec3(-1, -1, 4), glm::vec3(2, 2, 0), glm::vec3(1, 1, 0));
+
+  for(c=0;c<3;c++) {
+    TransformBatch batch;
+    vector<glm::mat4> out(counts[c]);
+    float sink=0;
+    reps=10000000/counts[c];
+
+    for(i=0;i<counts[c];i++)
+      batch.add(0.4*(i%1000), 0.4*(i/1000), 0);
+
+    auto start = chrono::steady_clock::now();
+    for(rep=0;rep<reps;rep++) {
+      for(i=0;i<counts[c];i++) {
+        glm::mat4 model = glm::mat4(1.0f);
+        model *= glm::translate (glm::vec3(batch.x[i], batch.y[i], batch.z[i]));
+        out[i] = VP * model;
+      }
+      sink+=out[rep%counts[c]][3][0];
+    }
+    double loop_ns = chrono::duration<double, nano>(chrono::steady_clock::now()-start).count()/((double)reps*counts[c]);
+
+    start = chrono::steady_clock::now();
+    for(rep=0;rep<reps;rep++) {
+      batch.dirty=1;
+      batch.compute(VP);
+      sink+=batch.MVP[rep%counts[c]][3][0];
+    }
+    double batch_ns = chrono::duration<double, nano>(chrono::steady_clock::now()-start).count()/((double)reps*counts[c]);
+
+    printf("%6d objects: per-object loop %.2f ns/object, batch %.2f ns/object (x%.1f) [%g]\n", counts[c], loop_ns, batch_ns, loop_ns/batch_ns, sink);
+  }
+}
+
+/* Executed when window is resized to 'width' and 'height' */
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void reshapeWindow (GLFWwindow* window, int width, int height)
+{
+    int fbwidth=width, fbheight=height;
+    /* With Retina display on Mac OS X, GLFW's FramebufferSize
+     is different from WindowSize */
+    //glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+
+  // set the projection matrix as perspective
+  /* glMatrixMode (GL_PROJECTION);
+     glLoadIdentity ();
+     gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
+  // Store the projection matrix in a variable for future use
+  // The board takes the lower 80% of the window, the HUD the rest
+  views.screen_width=fbwidth;
+  views.screen_height=(int)(0.8*fbheight);
+  camera.setViewport(views.screen_width/views.count, views.screen_height);
+}
+
+StaticMesh triangle;
+
+// Creates the triangle object used in this sample code
+void createTriangle ()
+{
+  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+
+  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
+  static const GLfloat vertex_buffer_data [] = {
+    0, 1,0, // vertex 0
+    -1,-1,0, // vertex 1
+    1,-1,0, // vertex 2
+  };
 
-    1,1,1, // color 3
-    1,1,1, // color 4
-    1,1,1  // color 1
+  static const GLfloat color_buffer_data [] = {
+    1,0,0, // color 0
+    0,1,0, // color 1
+    0,0,1, // color 2
   };
 
+  // Suballocated from the static mesh buffer, uploaded with the others
+  triangle = static_meshes.add(MEM_DEBUG, GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+}
+
+/**************************************
+ * Geometry generated at compile time *
+ **************************************/
+
+/* Corner signs (x, y, z) of the 36 cuboid vertices, scaled by the half
+   extents in makeCuboid. Six vertices (two triangles) per face. */
+constexpr signed char cuboid_corners[36][3] = {
+  // face 1
+  { 1, 1, 1}, { 1,-1, 1}, {-1,-1, 1}, {-1,-1, 1}, {-1, 1, 1}, { 1, 1, 1},
+  // face 2
+  { 1, 1,-1}, { 1,-1,-1}, {-1,-1,-1}, {-1,-1,-1}, {-1, 1,-1}, { 1, 1,-1},
+  // face 3
+  { 1, 1, 1}, { 1, 1,-1}, { 1,-1, 1}, { 1, 1,-1}, { 1,-1, 1}, { 1,-1,-1},
+  // face 4
+  {-1, 1, 1}, {-1, 1,-1}, {-1,-1, 1}, {-1, 1,-1}, {-1,-1, 1}, {-1,-1,-1},
+  // face 5
+  { 1, 1, 1}, {-1, 1, 1}, { 1, 1,-1}, {-1, 1, 1}, { 1, 1,-1}, {-1, 1,-1},
+  // face 6
+  {-1,-1, 1}, { 1,-1,-1}, {-1, 1, 1}, { 1,-1,-1}, {-1, 1, 1}, {-1,-1,-1},
+};
+
+struct CuboidMesh {
+  GLfloat vertices[36*3];
+  GLfloat colors[36*3];
+};
+
+struct QuadMesh {
+  GLfloat vertices[6*3];
+  GLfloat colors[6*3];
+};
+
+constexpr void fillCuboidVertices(CuboidMesh& mesh, float width, float length, float height) {
+  for(int i=0;i<36;i++) {
+    mesh.vertices[3*i] = cuboid_corners[i][0]*width;
+    mesh.vertices[3*i+1] = cuboid_corners[i][1]*length;
+    mesh.vertices[3*i+2] = cuboid_corners[i][2]*height;
+  }
+}
+
+/* Tiles shade every face from black to the tile color: red for normal,
+   yellow for fragile, magenta for bridge and white for the finish tile */
+constexpr CuboidMesh makeTileMesh(bool is_fragile, bool is_bridge) {
+  CuboidMesh mesh = {};
+  const float shade[6] = {0, 0.2, 0.4, 0.6, 0.6, 0.8};
+  fillCuboidVertices(mesh, 0.4/2, 0.4/2, 0.2/2);
+  for(int i=0;i<36;i++) {
+    mesh.colors[3*i] = shade[i%6];
+    mesh.colors[3*i+1] = is_fragile*shade[i%6];
+    mesh.colors[3*i+2] = is_bridge*shade[i%6];
+  }
+  return mesh;
+}
+
+/* The three ways the block can lie, also the index of its Block and shape */
+enum BlockName { BLOCK_Z, BLOCK_Y, BLOCK_X };
+
+/* Axis the arrow keys are relative to, see changeAxis() */
+enum Axis { AXIS_X, AXIS_Y };
+
+enum Move { MOVE_LEFT, MOVE_RIGHT, MOVE_UP, MOVE_DOWN };
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  *line_1 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_1, color_buffer_data_1, GL_FILL);
-  *line_2 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_2, color_buffer_data_2, GL_FILL);
+/* Full extents of the standing (z), lying along y and lying along x block */
+struct BlockShape {
+  float width;
+  float length;
+  float height;
+};
+
+constexpr BlockShape block_shapes[3] = {
+  {0.4, 0.4, 0.8},
+  {0.4, 0.8, 0.4},
+  {0.8, 0.4, 0.4},
+};
+
+/* Blue block with the two faces of its long axis painted yellow */
+constexpr CuboidMesh makeBlockMesh(int shape) {
+  CuboidMesh mesh = {};
+  fillCuboidVertices(mesh, block_shapes[shape].width/2, block_shapes[shape].length/2, block_shapes[shape].height/2);
+  // faces 1-2 are z, 3-4 are x and 5-6 are y
+  int highlight = shape == 0 ? 0 : (shape == 2 ? 1 : 2);
+  for(int i=0;i<36;i++) {
+    bool yellow = i/12 == highlight;
+    mesh.colors[3*i] = yellow ? 0.5 : 0;
+    mesh.colors[3*i+1] = yellow ? 0.5 : 0.3;
+    mesh.colors[3*i+2] = yellow ? 0 : 1;
+  }
+  return mesh;
+}
+
+/* One dark red seven-segment bar centered at (x_shift, y_shift) */
+constexpr QuadMesh makeSegment(float x_shift, float y_shift, float x_coord, float y_coord) {
+  QuadMesh mesh = {};
+  const float corners[6][2] = {{-1,-1}, {-1,1}, {1,1}, {1,1}, {1,-1}, {-1,-1}};
+  for(int i=0;i<6;i++) {
+    mesh.vertices[3*i] = corners[i][0]*x_coord+x_shift;
+    mesh.vertices[3*i+1] = corners[i][1]*y_coord+y_shift;
+    mesh.vertices[3*i+2] = 0;
+    mesh.colors[3*i] = 0.5;
+    mesh.colors[3*i+1] = 0;
+    mesh.colors[3*i+2] = 0;
+  }
+  return mesh;
 }
 
+// indexed by is_fragile + 2*is_bridge
+constexpr CuboidMesh tile_meshes[4] = {
+  makeTileMesh(0, 0), makeTileMesh(1, 0), makeTileMesh(0, 1), makeTileMesh(1, 1),
+};
+
+constexpr CuboidMesh block_meshes[3] = {
+  makeBlockMesh(0), makeBlockMesh(1), makeBlockMesh(2),
+};
+
+// segments a to g
+constexpr QuadMesh segment_meshes[7] = {
+  makeSegment(0, 0.25, 0.09, 0.04),
+  makeSegment(0.11, 0.12, 0.025, 0.12),
+  makeSegment(0.11, -0.12, 0.025, 0.12),
+  makeSegment(0, -0.25, 0.09, 0.04),
+  makeSegment(-0.11, -0.12, 0.025, 0.12),
+  makeSegment(-0.11, 0.12, 0.025, 0.12),
+  makeSegment(0, 0, 0.09, 0.04),
+};
+
+// lit segments per digit, bit 0 is a and bit 6 is g; 10 lights all of them
+constexpr unsigned char digit_segments[11] = {
+  0x3f, 0x06, 0x5b, 0x4f, 0x66, 0x6d, 0x7d, 0x07, 0x7f, 0x6f, 0x7f,
+};
+
 float camera_rotation_angle = 90;
 float rectangle_rotation = 0;
 float triangle_rotation = 0;
 float currX, currY, TIME_X, TIME_Y, TIME_Z, SCORE_X, SCORE_Y, SCORE_Z;
 int currIndexX, currIndexY;
 
-class CuboidColor {
-  public:
-    float face[6][3];
-};
-
-void createCuboid(float length, float width, float height, VAO** cuboid, bool block, CuboidColor color, bool is_fragile, bool is_bridge) {
-
-  GLfloat vertex_buffer_data [] = {
-
-    // face 1
-    width,length,height, // vertex 1
-    width,-length,height, // vertex 2
-    -width,-length,height, // vertex 3
-    -width,-length,height, // vertex 3
-    -width, length,height, // vertex 4
-    width,length,height, // vertex 1
-
-    // face 2
-    width,length,-height, // vertex 5
-    width,-length,-height, // vertex 6
-    -width,-length,-height, // vertex 7
-    -width,-length,-height, // vertex 7
-    -width, length,-height, // vertex 8
-    width,length,-height, // vertex 5
-
-    // face 3
-    width,length,height, // vertex 1
-    width,length,-height, // vertex 5
-    width,-length,height, // vertex 2
-
-    width,length,-height, // vertex 5
-    width,-length,height, // vertex 2
-    width,-length,-height, // vertex 6
-
-    // face 4
-    -width, length,height, // vertex 4
-    -width, length,-height, // vertex 8
-    -width,-length,height, // vertex 3
-
-    -width, length,-height, // vertex 8
-    -width,-length,height, // vertex 3
-    -width,-length,-height, // vertex 7
-
-    // face 5
-    width,length,height, // vertex 1
-    -width, length,height, // vertex 4
-    width,length,-height, // vertex 5
-
-    -width, length,height, // vertex 4
-    width,length,-height, // vertex 5
-    -width, length,-height, // vertex 8
-
-    // face 6
-    -width,-length,height, // vertex 3
-    width,-length,-height, // vertex 6
-    -width, length,height, // vertex 4
-
-    width,-length,-height, // vertex 6
-    -width, length,height, // vertex 4
-    -width,-length,-height, // vertex 7
-  };
+StaticMesh block_bodies[3], segment_bodies[7];
 
+/* Stages the compile time meshes and uploads them in one buffer pair */
+void createStaticMeshes() {
   int i;
-  if(!block) {
-    GLfloat color_buffer_data [] = {
-      
-      // face 1 (top-face)
-      0,0,0,
-      0.2,is_fragile*0.2,is_bridge*0.2,
-      0.4,is_fragile*0.4,is_bridge*0.4,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.8,is_fragile*0.8,is_bridge*0.8,
-
-      // face 2 (top-face)
-      0,0,0,
-      0.2,is_fragile*0.2,is_bridge*0.2,
-      0.4,is_fragile*0.4,is_bridge*0.4,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.8,is_fragile*0.8,is_bridge*0.8,
-
-      // face 3
-      0,0,0,
-      0.2,is_fragile*0.2,is_bridge*0.2,
-      0.4,is_fragile*0.4,is_bridge*0.4,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.8,is_fragile*0.8,is_bridge*0.8,
-      // face 4
-      0,0,0,
-      0.2,is_fragile*0.2,is_bridge*0.2,
-      0.4,is_fragile*0.4,is_bridge*0.4,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.8,is_fragile*0.8,is_bridge*0.8,
-      // face 5
-      0,0,0,
-      0.2,is_fragile*0.2,is_bridge*0.2,
-      0.4,is_fragile*0.4,is_bridge*0.4,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.8,is_fragile*0.8,is_bridge*0.8,
-      // face 6
-      0,0,0,
-      0.2,is_fragile*0.2,is_bridge*0.2,
-      0.4,is_fragile*0.4,is_bridge*0.4,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.6,is_fragile*0.6,is_bridge*0.6,
-      0.8,is_fragile*0.8,is_bridge*0.8,
-    };
-    *cuboid = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
-  }
-  else {
-    GLfloat color_buffer_data [] = {
-      // face 1 (top-face)
-      color.face[0][0],color.face[0][1],color.face[0][2],
-      color.face[0][0],color.face[0][1],color.face[0][2],
-      color.face[0][0],color.face[0][1],color.face[0][2],
-      color.face[0][0],color.face[0][1],color.face[0][2],
-      color.face[0][0],color.face[0][1],color.face[0][2],
-      color.face[0][0],color.face[0][1],color.face[0][2],
-      // face 2 (top-face)
-      color.face[1][0],color.face[1][1],color.face[1][2],
-      color.face[1][0],color.face[1][1],color.face[1][2],
-      color.face[1][0],color.face[1][1],color.face[1][2],
-      color.face[1][0],color.face[1][1],color.face[1][2],
-      color.face[1][0],color.face[1][1],color.face[1][2],
-      color.face[1][0],color.face[1][1],color.face[1][2],
-      // face 3
-      color.face[2][0],color.face[2][1],color.face[2][2],
-      color.face[2][0],color.face[2][1],color.face[2][2],
-      color.face[2][0],color.face[2][1],color.face[2][2],
-      color.face[2][0],color.face[2][1],color.face[2][2],
-      color.face[2][0],color.face[2][1],color.face[2][2],
-      color.face[2][0],color.face[2][1],color.face[2][2],
-      // face 4
-      color.face[3][0],color.face[3][1],color.face[3][2],
-      color.face[3][0],color.face[3][1],color.face[3][2],
-      color.face[3][0],color.face[3][1],color.face[3][2],
-      color.face[3][0],color.face[3][1],color.face[3][2],
-      color.face[3][0],color.face[3][1],color.face[3][2],
-      color.face[3][0],color.face[3][1],color.face[3][2],
-      // face 5
-      color.face[4][0],color.face[4][1],color.face[4][2],
-      color.face[4][0],color.face[4][1],color.face[4][2],
-      color.face[4][0],color.face[4][1],color.face[4][2],
-      color.face[4][0],color.face[4][1],color.face[4][2],
-      color.face[4][0],color.face[4][1],color.face[4][2],
-      color.face[4][0],color.face[4][1],color.face[4][2],
-      // face 6
-      color.face[5][0],color.face[5][1],color.face[5][2],
-      color.face[5][0],color.face[5][1],color.face[5][2],
-      color.face[5][0],color.face[5][1],color.face[5][2],
-      color.face[5][0],color.face[5][1],color.face[5][2],
-      color.face[5][0],color.face[5][1],color.face[5][2],
-      color.face[5][0],color.face[5][1],color.face[5][2],
-    };
-    *cuboid = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
-  }
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
+  createTriangle();
+  for(i=0;i<3;i++)
+    block_bodies[i] = static_meshes.add(MEM_BLOCK, GL_TRIANGLES, 36, block_meshes[i].vertices, block_meshes[i].colors, GL_FILL);
+  for(i=0;i<7;i++)
+    segment_bodies[i] = static_meshes.add(MEM_HUD, GL_TRIANGLES, 6, segment_meshes[i].vertices, segment_meshes[i].colors, GL_FILL);
+
+  static_meshes.upload();
 }
 
 int total_time, total_score, DYING;
+int player_count = 1;
+int active_player;      // whose state the globals hold, see usePlayer()
+
+// A roll takes as long as the old 3 degrees per frame at 60fps did
+#define ROLL_DURATION 0.5f
+#define FALL_SPEED 4.8f
+#define FALL_SPIN (M_PI)
+#define FALL_DURATION (10/FALL_SPEED)
+
+double game_epoch;
+float fall_start;
+bool block_anim_dirty;
+
+// Simulated seconds while a soak test drives the game, negative otherwise
+double sim_clock = -1;
+
+/* Wall clock the game runs on, or the soak test's simulated one */
+double gameClock() {
+  return sim_clock >= 0 ? sim_clock : glfwGetTime();
+}
+
+/* Seconds since the current level was built, the clock block animations run on */
+float getGameTime() {
+  return gameClock() - game_epoch;
+}
 
 double mouse_xpos, mouse_ypos;
 
-float currAxis[3], DYING_inc, DYING_rot, prev_mouse_x, prev_mouse_y;
+float currAxis[3], prev_mouse_x, prev_mouse_y;
 
 bool change_level, Y_NEG, Y_POS, X_NEG, X_POS, vert_fall;
 
@@ -547,11 +1576,11 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
   mouse_yoffset=yoffset;
 }
 
-string getAxis() {
+Axis getAxis() {
   if(currAxis[0]==1.0)
-    return "x";
+    return AXIS_X;
   else
-    return "y";
+    return AXIS_Y;
 }
 
 void changeAxis() {
@@ -577,7 +1606,7 @@ class SevenSegment {
       float x_shift;
       float length;
       float width;
-      VAO *a, *b, *c, *d, *e, *f, *g;
+      const StaticMesh *a, *b, *c, *d, *e, *f, *g;
       bool A, B, C, D, E, F, G;
 
       void create (float X_SHIFT, float Y_SHIFT, int number) {
@@ -586,261 +1615,40 @@ class SevenSegment {
         this->y_shift = Y_SHIFT;
         this->A=1; this->B=1; this->C=1; this->D=1; this->E=1; this->F=1; this->G=1;
 
-        float x_coord, y_coord, red=0.5, blue=0, green=0, x_shift, y_shift;
-
         if(number > 10 || number < 0 ) 
           return;
 
-        switch(number){
-          case 0:
-            this->G=0;
-            break; //optional
-          case 1:
-            this->G=0;
-            this->F=0;
-            this->E=0;
-            this->A=0;
-            this->D=0;
-            break; //optional
-          case 2:
-            this->F=0;
-            this->C=0;
-            break; //optional
-          case 3:
-            this->F=0;
-            this->E=0;
-            break; //optional
-          case 4:
-            this->A=0;
-            this->E=0;
-            this->D=0;
-            break; //optional
-          case 5:
-            this->B=0;
-            this->E=0;
-            break; //optional
-          case 6:
-            this->B=0;
-            break; //optional
-          case 7:
-            this->G=0;
-            this->E=0;
-            this->F=0;
-            this->D=0;
-            break; //optional
-          case 8:
-            break; //optional
-          case 9:
-            this->E=0;
-            break; //optional
-        }
-        
-        if(this->G) {
-          y_shift = 0, x_coord=0.09, y_coord=0.04, x_shift=0;
-
-          GLfloat vertex_buffer_data_g [] = {
-            -x_coord+x_shift,-y_coord+y_shift,0, // vertex 1
-            -x_coord+x_shift,y_coord+y_shift,0, // vertex 2
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-            x_coord+x_shift,-y_coord+y_shift,0, // vertex 4
-            -x_coord+x_shift,-y_coord+y_shift,0  // vertex 1
-          };
-
-          GLfloat color_buffer_data_g [] = {
-            red,green,blue, // color 1
-            red,green,blue, // color 2
-            red,green,blue, // color 3
-
-            red,green,blue, // color 3
-            red,green,blue, // color 4
-            red,green,blue  // color 1
-          };
-
-          G = 1;
-          this->g = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_g, color_buffer_data_g, GL_FILL);
-        }
-
-        if(this->A) {
-          y_shift = 0.25, x_coord=0.09, y_coord=0.04, x_shift=0;
-
-          GLfloat vertex_buffer_data_a [] = {
-            -x_coord+x_shift,-y_coord+y_shift,0, // vertex 1
-            -x_coord+x_shift,y_coord+y_shift,0, // vertex 2
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-            x_coord+x_shift,-y_coord+y_shift,0, // vertex 4
-            -x_coord+x_shift,-y_coord+y_shift,0  // vertex 1
-          };
-
-          GLfloat color_buffer_data_a [] = {
-            red,green,blue, // color 1
-            red,green,blue, // color 2
-            red,green,blue, // color 3
+        unsigned char lit = digit_segments[number];
+        bool* flags[7] = {&this->A, &this->B, &this->C, &this->D, &this->E, &this->F, &this->G};
+        const StaticMesh** segments[7] = {&this->a, &this->b, &this->c, &this->d, &this->e, &this->f, &this->g};
 
-            red,green,blue, // color 3
-            red,green,blue, // color 4
-            red,green,blue  // color 1
-          };
-
-          A = 1;
-          this->a = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_a, color_buffer_data_a, GL_FILL);
-        }
-
-        if(this->D) {
-          x_coord=0.09, y_coord=0.04, x_shift=0, y_shift = -0.25;
-
-          GLfloat vertex_buffer_data_d [] = {
-            -x_coord+x_shift,-y_coord+y_shift,0, // vertex 1
-            -x_coord+x_shift,y_coord+y_shift,0, // vertex 2
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-            x_coord+x_shift,-y_coord+y_shift,0, // vertex 4
-            -x_coord+x_shift,-y_coord+y_shift,0  // vertex 1
-          };
-
-          GLfloat color_buffer_data_d [] = {
-            red,green,blue, // color 1
-            red,green,blue, // color 2
-            red,green,blue, // color 3
-
-            red,green,blue, // color 3
-            red,green,blue, // color 4
-            red,green,blue  // color 1
-          };
-
-          D = 1;
-          this->d = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_d, color_buffer_data_d, GL_FILL);
-        }
-
-        if(this->C) {
-          x_shift = 0.11, x_coord=0.025, y_coord=0.12, y_shift=-0.12;
-
-          GLfloat vertex_buffer_data_c [] = {
-            -x_coord+x_shift,-y_coord+y_shift,0, // vertex 1
-            -x_coord+x_shift,y_coord+y_shift,0, // vertex 2
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-            x_coord+x_shift,-y_coord+y_shift,0, // vertex 4
-            -x_coord+x_shift,-y_coord+y_shift,0  // vertex 1
-          };
-
-          GLfloat color_buffer_data_c [] = {
-            red,green,blue, // color 1
-            red,green,blue, // color 2
-            red,green,blue, // color 3
-
-            red,green,blue, // color 3
-            red,green,blue, // color 4
-            red,green,blue  // color 1
-          };
-
-          C = 1;
-          this->c = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_c, color_buffer_data_c, GL_FILL);
-        }
-
-        
-        if(this->B) {
-          x_shift = 0.11, x_coord=0.025, y_coord=0.12, y_shift=0.12;
-
-          GLfloat vertex_buffer_data_b [] = {
-            -x_coord+x_shift,-y_coord+y_shift,0, // vertex 1
-            -x_coord+x_shift,y_coord+y_shift,0, // vertex 2
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-            x_coord+x_shift,-y_coord+y_shift,0, // vertex 4
-            -x_coord+x_shift,-y_coord+y_shift,0  // vertex 1
-          };
-
-          GLfloat color_buffer_data_b [] = {
-            red,green,blue, // color 1
-            red,green,blue, // color 2
-            red,green,blue, // color 3
-
-            red,green,blue, // color 3
-            red,green,blue, // color 4
-            red,green,blue  // color 1
-          };
-
-          B = 1;
-          this->b = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_b, color_buffer_data_b, GL_FILL);
-        }
-
-        if(this->E) {
-          x_shift = -0.11, x_coord=0.025, y_coord=0.12, y_shift=-0.12;
-
-          GLfloat vertex_buffer_data_e [] = {
-            -x_coord+x_shift,-y_coord+y_shift,0, // vertex 1
-            -x_coord+x_shift,y_coord+y_shift,0, // vertex 2
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-            x_coord+x_shift,-y_coord+y_shift,0, // vertex 4
-            -x_coord+x_shift,-y_coord+y_shift,0  // vertex 1
-          };
-
-          GLfloat color_buffer_data_e [] = {
-            red,green,blue, // color 1
-            red,green,blue, // color 2
-            red,green,blue, // color 3
-
-            red,green,blue, // color 3
-            red,green,blue, // color 4
-            red,green,blue  // color 1
-          };
-
-          E = 1;
-          this->e = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_e, color_buffer_data_e, GL_FILL);
-        }
-
-        if(this->F) {
-          x_shift = -0.11, x_coord=0.025, y_coord=0.12, y_shift=0.12;
-
-          GLfloat vertex_buffer_data_f [] = {
-            -x_coord+x_shift,-y_coord+y_shift,0, // vertex 1
-            -x_coord+x_shift,y_coord+y_shift,0, // vertex 2
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-
-            x_coord+x_shift,y_coord+y_shift,0, // vertex 3
-            x_coord+x_shift,-y_coord+y_shift,0, // vertex 4
-            -x_coord+x_shift,-y_coord+y_shift,0  // vertex 1
-          };
-
-          GLfloat color_buffer_data_f [] = {
-            red,green,blue, // color 1
-            red,green,blue, // color 2
-            red,green,blue, // color 3
-
-            red,green,blue, // color 3
-            red,green,blue, // color 4
-            red,green,blue  // color 1
-          };
-
-          F = 1;
-          this->f = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data_f, color_buffer_data_f, GL_FILL);
+        for(int i=0;i<7;i++) {
+          *flags[i] = (lit>>i)&1;
+          if(*flags[i])
+            *segments[i] = &segment_bodies[i];
         }
       }
 };
 
-SevenSegment score_board[4];
+// Score, clock, and in two-player mode the second player's score
+#define HUD_DIGITS (2*(player_count+1))
+SevenSegment score_board[6];
 
+/* The active player's score, the second player's sits right of center */
 void updateScore (float x, float y) {
+  SevenSegment* digits = score_board;
+  if(active_player) {
+    digits = score_board+4;
+    x = 1.5;
+  }
   if((total_score/100)==0) {
-    score_board[0].create(x, y, total_score%10);
-    score_board[1].create(x-0.3, y, total_score/10);
+    digits[0].create(x, y, total_score%10);
+    digits[1].create(x-0.3, y, total_score/10);
   }
 }
 
 class Tiles {
   public:
-    VAO* body;
-    VAO* line_1;
-    VAO* line_2;
     float width;
     float height;
     float length;
@@ -852,12 +1660,10 @@ class Tiles {
     bool is_fragile;
     bool is_finish;
     bool toggle_swtich;
+    int mesh;
 
     void create(bool is_switch, bool is_fragile, bool is_bridge) {
 
-      int i;
-      CuboidColor block_color;
-
       if(is_bridge&&is_fragile) {
         this->is_finish=1;
         this->is_fragile=0;
@@ -876,180 +1682,981 @@ class Tiles {
       this->is_switch=is_switch;
       this->toggle_swtich=0;
 
-      createCuboid(this->length/2, this->width/2, this->height/2, &this->body, 0, block_color, is_fragile, is_bridge);
-      if(this->is_switch)
-        createSwitch(&line_1, &line_2, this->width/2, this->length/2, this->height/2);
+      // The geometry itself is baked into the tile's board chunk
+      this->mesh = is_fragile + 2*is_bridge;
 
     }
 };
 
-class Block {
-  public:
-    VAO* body;
-    float width;
-    float height;
-    float length;
-    float x;
-    float y;
-    float z;
-    float rotate_angle_y;
-    float rotate_angle_x;
-    float temp_rotate_x;
-    float temp_rotate_y;
-    bool status;
-    bool standing;
-    bool rotate_status;
-    bool left;
-    bool right;
-    bool up;
-    bool down;
-    string name;
-    glm::mat4 tempTranslate;
-    glm::mat4 invTempTranslate;
-
-    void create(float width, float length, float height, string name) {
-
-      CuboidColor block_color;
-      int i;
+#define PARTICLE_CAPACITY 32768
+#define PARTICLE_MAX_BURSTS 4
+#define PARTICLE_LIFE 1.6f
+#define PARTICLE_GRAVITY 6.0f
+#define PARTICLE_SIZE 0.03f
+
+/* One burst queued for the next simulation step */
+struct ParticleBurst {
+  glm::vec3 origin;
+  glm::vec3 extent;
+  glm::vec3 color;
+  float speed;
+  int first;
+  int size;
+};
 
-      this->name=name;
-      this->width=width;
-      this->length=length;
-      this->height=height;
-      if(name == "z")
-        this->status=1;
-      else
-        this->status=0;
-      this->standing=1;
-      this->rotate_angle_y=0;
-      this->rotate_angle_x=0;
-      this->x=0;
-      this->y=0;
-      this->z=0;
-      this->right=0;
-      this->left=0;
-      this->up=0;
-      this->down=0;
-      this->rotate_status=0;
-      this->temp_rotate_x=0;
-      this->temp_rotate_y=0;
-      this->tempTranslate = glm::translate (glm::vec3(0, 0, this->height/2));
-      this->invTempTranslate = glm::translate (glm::vec3(0, 0, 0.1));
-
-      for(i=0;i<6;i++) {
-        block_color.face[i][0]=0;
-        block_color.face[i][1]=0.3;
-        block_color.face[i][2]=1;
-      }
-
-      if(name == "z") {
-        block_color.face[0][0]=0.5;
-        block_color.face[0][1]=0.5;
-        block_color.face[0][2]=0;
-        block_color.face[1][0]=0.5;
-        block_color.face[1][1]=0.5;
-        block_color.face[1][2]=0;
-      }
-      else if(name == "x") {
-        block_color.face[2][0]=0.5;
-        block_color.face[2][1]=0.5;
-        block_color.face[2][2]=0;
-        block_color.face[3][0]=0.5;
-        block_color.face[3][1]=0.5;
-        block_color.face[3][2]=0;
+/* Debris and dust, simulated entirely on the GPU. Every particle lives in
+   one of two interleaved buffers, ParticleUpdate_GL.vert reads one and
+   transform feedback writes the next step into the other. Bursts only
+   reserve a range of the ring and upload a few uniforms, the shader seeds
+   the particles itself, so the CPU cost does not grow with the count. */
+class ParticleSystem {
+  public:
+    GLuint update_program;
+    GLuint draw_program;
+    GLuint vertex_arrays[2];
+    GLuint buffers[2];
+    int source;
+    int next_slot;
+    double last_step;
+    double alive_until;   // no particle is alive after this, skip the GPU work
+    vector<ParticleBurst> bursts;
+
+    struct {
+      GLint dt, gravity, seed, capacity;
+      GLint burstCount, burstFirst, burstSize, burstOrigin, burstExtent, burstColor, burstSpeed, burstLife;
+    } update_uniforms;
+
+    struct {
+      GLint VP, views, pointScale;
+    } draw_uniforms;
+
+    void create() {
+      const char* varyings[] = {"outPosition", "outVelocity", "outColor", "outLife"};
+      this->update_program = LoadFeedbackShader("ParticleUpdate_GL.vert", varyings, 4);
+      this->update_uniforms.dt = glGetUniformLocation(this->update_program, "dt");
+      this->update_uniforms.gravity = glGetUniformLocation(this->update_program, "gravity");
+      this->update_uniforms.seed = glGetUniformLocation(this->update_program, "seed");
+      this->update_uniforms.capacity = glGetUniformLocation(this->update_program, "capacity");
+      this->update_uniforms.burstCount = glGetUniformLocation(this->update_program, "burstCount");
+      this->update_uniforms.burstFirst = glGetUniformLocation(this->update_program, "burstFirst");
+      this->update_uniforms.burstSize = glGetUniformLocation(this->update_program, "burstSize");
+      this->update_uniforms.burstOrigin = glGetUniformLocation(this->update_program, "burstOrigin");
+      this->update_uniforms.burstExtent = glGetUniformLocation(this->update_program, "burstExtent");
+      this->update_uniforms.burstColor = glGetUniformLocation(this->update_program, "burstColor");
+      this->update_uniforms.burstSpeed = glGetUniformLocation(this->update_program, "burstSpeed");
+      this->update_uniforms.burstLife = glGetUniformLocation(this->update_program, "burstLife");
+
+      this->draw_program = LoadShaders("Particle_GL.vert", "Sample_GL.frag");
+      this->draw_uniforms.VP = glGetUniformLocation(this->draw_program, "VP");
+      this->draw_uniforms.views = glGetUniformLocation(this->draw_program, "views");
+      this->draw_uniforms.pointScale = glGetUniformLocation(this->draw_program, "pointScale");
+
+      this->bursts.reserve(PARTICLE_MAX_BURSTS);
+
+      // position, velocity, color and remaining life, all zero means dead
+      const int stride = 10*sizeof(GLfloat);
+      vector<GLfloat> dead(10*PARTICLE_CAPACITY, 0.0f);
+      // Debris of the board's tiles
+      memory_ledger.allocate(MEM_BOARD, 2*dead.size()*sizeof(GLfloat), 0);
+
+      if(gl_caps.immutable) {
+        // Transform feedback writes from the GPU, so no client access is needed
+        glCreateVertexArrays(2, this->vertex_arrays);
+        for(int i=0;i<2;i++) {
+          this->buffers[i] = upload_ring.upload(&dead[0], dead.size()*sizeof(GLfloat));
+          glVertexArrayVertexBuffer(this->vertex_arrays[i], 0, this->buffers[i], 0, stride);
+          glVertexArrayAttribFormat(this->vertex_arrays[i], 0, 3, GL_FLOAT, GL_FALSE, 0);
+          glVertexArrayAttribFormat(this->vertex_arrays[i], 1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat));
+          glVertexArrayAttribFormat(this->vertex_arrays[i], 2, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat));
+          glVertexArrayAttribFormat(this->vertex_arrays[i], 3, 1, GL_FLOAT, GL_FALSE, 9*sizeof(GLfloat));
+          for(int a=0;a<4;a++) {
+            glVertexArrayAttribBinding(this->vertex_arrays[i], a, 0);
+            glEnableVertexArrayAttrib(this->vertex_arrays[i], a);
+          }
+        }
       }
       else {
-        block_color.face[4][0]=0.5;
-        block_color.face[4][1]=0.5;
-        block_color.face[4][2]=0;
-        block_color.face[5][0]=0.5;
-        block_color.face[5][1]=0.5;
-        block_color.face[5][2]=0;
+        glGenVertexArrays(2, this->vertex_arrays);
+        glGenBuffers(2, this->buffers);
+        for(int i=0;i<2;i++) {
+          glBindVertexArray(this->vertex_arrays[i]);
+          glBindBuffer(GL_ARRAY_BUFFER, this->buffers[i]);
+          glBufferData(GL_ARRAY_BUFFER, dead.size()*sizeof(GLfloat), &dead[0], GL_DYNAMIC_COPY);
+          glEnableVertexAttribArray(0);
+          glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+          glEnableVertexAttribArray(1);
+          glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3*sizeof(GLfloat)));
+          glEnableVertexAttribArray(2);
+          glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void*)(6*sizeof(GLfloat)));
+          glEnableVertexAttribArray(3);
+          glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride, (void*)(9*sizeof(GLfloat)));
+        }
+        bound_vertex_array = this->vertex_arrays[1];
       }
 
-      createCuboid(this->length/2, this->width/2, this->height/2, &this->body, 1, block_color, 0, 0);
+      this->source=0;
+      this->next_slot=0;
+      this->last_step=gameClock();
+      this->alive_until=0;
+    }
 
+    /* Queues count particles around origin, spawned on the next update */
+    void burst(glm::vec3 origin, glm::vec3 extent, glm::vec3 color, float speed, int count) {
+      if((int)this->bursts.size() >= PARTICLE_MAX_BURSTS)
+        return;
+      count = min(count, PARTICLE_CAPACITY);
+      ParticleBurst burst = {origin, extent, color, speed, this->next_slot, count};
+      this->bursts.push_back(burst);
+      this->next_slot = (this->next_slot+count)%PARTICLE_CAPACITY;
     }
 
-    void revolve_block(string move) {
-      if(!this->rotate_status) {
-        total_score++;
-        updateScore(-3, 0);
-        if(this->standing)
-          this->standing=0;
-        else
-          this->standing=1;
-        if(move == "left") {
-          this->left=1;
-          this->tempTranslate=glm::translate (glm::vec3(this->width/2, 0, this->height/2));
-          this->invTempTranslate=glm::translate (glm::vec3(-this->width/2, 0, 0.1));
-        }
-        else if(move == "right") {
-          this->right=1;
-          this->tempTranslate=glm::translate (glm::vec3(-this->width/2, 0, this->height/2));
-          this->invTempTranslate=glm::translate (glm::vec3(this->width/2, 0, 0.1));
+    void update() {
+      double now = gameClock();
+      float dt = min(now-this->last_step, 0.1);
+      this->last_step = now;
+      if(this->bursts.empty() && now > this->alive_until)
+        return;
+
+      glUseProgram(this->update_program);
+      glUniform1f(this->update_uniforms.dt, dt);
+      glUniform1f(this->update_uniforms.gravity, PARTICLE_GRAVITY);
+      glUniform1f(this->update_uniforms.seed, fmod(now, 1000.0));
+      glUniform1i(this->update_uniforms.capacity, PARTICLE_CAPACITY);
+      glUniform1f(this->update_uniforms.burstLife, PARTICLE_LIFE);
+
+      int count = this->bursts.size();
+      if(count) {
+        GLint first[PARTICLE_MAX_BURSTS], size[PARTICLE_MAX_BURSTS];
+        glm::vec3 origin[PARTICLE_MAX_BURSTS], extent[PARTICLE_MAX_BURSTS], color[PARTICLE_MAX_BURSTS];
+        GLfloat speed[PARTICLE_MAX_BURSTS];
+        for(int i=0;i<count;i++) {
+          first[i]=this->bursts[i].first;
+          size[i]=this->bursts[i].size;
+          origin[i]=this->bursts[i].origin;
+          extent[i]=this->bursts[i].extent;
+          color[i]=this->bursts[i].color;
+          speed[i]=this->bursts[i].speed;
         }
-        else if(move == "up") {
-          this->up=1;
-          this->tempTranslate=glm::translate (glm::vec3(0, -this->length/2, this->height/2));
-          this->invTempTranslate=glm::translate (glm::vec3(0, this->length/2, 0.1));
-        }
-        else {
-          this->down=1;
-          this->tempTranslate=glm::translate (glm::vec3(0, this->length/2, this->height/2));
-          this->invTempTranslate=glm::translate (glm::vec3(0, -this->length/2, 0.1));
-        }
-        //changeAxis();
-        this->rotate_status=1;
+        glUniform1iv(this->update_uniforms.burstFirst, count, first);
+        glUniform1iv(this->update_uniforms.burstSize, count, size);
+        glUniform3fv(this->update_uniforms.burstOrigin, count, &origin[0][0]);
+        glUniform3fv(this->update_uniforms.burstExtent, count, &extent[0][0]);
+        glUniform3fv(this->update_uniforms.burstColor, count, &color[0][0]);
+        glUniform1fv(this->update_uniforms.burstSpeed, count, speed);
+        this->alive_until = now+PARTICLE_LIFE;
+        this->bursts.clear();
       }
+      glUniform1i(this->update_uniforms.burstCount, count);
+
+      // Nothing is rasterized, the vertex outputs go straight to the other buffer
+      glEnable(GL_RASTERIZER_DISCARD);
+      glBindVertexArray(this->vertex_arrays[this->source]);
+      bound_vertex_array = this->vertex_arrays[this->source];
+      glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, this->buffers[1-this->source]);
+      glBeginTransformFeedback(GL_POINTS);
+      glDrawArrays(GL_POINTS, 0, PARTICLE_CAPACITY);
+      glEndTransformFeedback();
+      glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+      glDisable(GL_RASTERIZER_DISCARD);
+      this->source = 1-this->source;
+    }
 
+    void draw(const glm::mat4& projection, int viewport_height) {
+      if(gameClock() > this->alive_until)
+        return;
+
+      glUseProgram(this->draw_program);
+      uploadViews(this->draw_uniforms.VP, this->draw_uniforms.views);
+      glUniform1f(this->draw_uniforms.pointScale, PARTICLE_SIZE*projection[1][1]*viewport_height/2);
+      glEnable(GL_PROGRAM_POINT_SIZE);
+      glBindVertexArray(this->vertex_arrays[this->source]);
+      bound_vertex_array = this->vertex_arrays[this->source];
+      glDrawArraysInstanced(GL_POINTS, 0, PARTICLE_CAPACITY, views.count);
+      glDisable(GL_PROGRAM_POINT_SIZE);
     }
 };
 
-Tiles tiles[10][10];
+ParticleSystem particles;
+
+#define CHUNK_SIZE 16
+#define CHUNK_BUDGET_BYTES (64<<20)
+#define CHUNK_BAKES_PER_FRAME 4
+#define CHUNK_DRAW_DISTANCE 30.0f
+#define CHUNK_LOD_DISTANCE 12.0f
+// A board that is not drawn yet only gets the chunks in reach of the
+// start tile, and no more than this share of the budget
+#define CHUNK_PREFETCH_BYTES (CHUNK_BUDGET_BYTES/4)
+#define DRAW_ORDER_SLOTS 16
+
+/* FNV-1a, enough to tell whether baked data changed */
+unsigned hashBytes(const void* data, size_t size, unsigned hash=2166136261u) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  for(size_t i=0;i<size;i++)
+    hash = (hash ^ bytes[i]) * 16777619u;
+  return hash;
+}
 
-Block block[3];
+/* What each buffer of a baked chunk mesh was last filled with */
+struct MeshHashes {
+  unsigned vertices;
+  unsigned colors;
+  unsigned switches;
+};
 
-bool top_view, tower_view, level_view, block_view, front_view;
+/* CHUNK_SIZE x CHUNK_SIZE tiles baked into one vertex buffer */
+class Chunk {
+  public:
+    VAO* mesh;            // NULL while not resident on the GPU
+    VAO* lod_mesh;        // greedy merged tile tops, drawn from afar
+    int first_x;
+    int first_y;
+    int bytes;
+    int last_used;        // frame the chunk was last drawn in
+    bool dirty;
+    bool empty;
+    glm::vec3 center;
+    // Tiles the meshes were baked from, a rebuilt level that matches keeps them
+    unsigned signature;
+    MeshHashes hashes;
+    MeshHashes lod_hashes;
+};
 
-int currLevel;
+/* Vertex, color and switch arrays for one chunk bake, from frame_arena */
+struct ChunkStaging {
+  GLfloat* vertices;
+  GLfloat* colors;
+  GLubyte* switches;
+  int count;
+
+  void create(int capacity) {
+    this->vertices=frame_arena.alloc<GLfloat>(3*capacity);
+    this->colors=frame_arena.alloc<GLfloat>(3*capacity);
+    this->switches=frame_arena.alloc<GLubyte>(capacity);
+    this->count=0;
+  }
 
-void getCurrIndex() {
-  int i, j;
-  for(i=0;i<3;i++) {
-    if(block[i].name == "z"&&block[i].status==1) {
-      currIndexX=currX/0.4;
-      currIndexY=currY/0.4;
-    }
+  int bytes() const {
+    return 2*3*this->count*sizeof(GLfloat) + this->count;
   }
-}
 
-void rotate_block() {
-  int i;
-  for(i=0;i<3;i++) {
-    if(block[i].rotate_status) {
-      if(block[i].left) {
-        block[i].rotate_angle_y-=3;
-        if(block[i].rotate_angle_y<=-91) {
-          Y_NEG=1;
-          Y_POS=0;
-          X_POS=0;
-          X_NEG=0;
-          block[i].rotate_status=0;
-          block[i].left=0;
-          block[i].rotate_angle_y=0;
-          block[i].tempTranslate = glm::translate (glm::vec3(0, 0, block[i].height/2));
-          block[i].invTempTranslate=glm::translate (glm::vec3(0, 0, 0.1));
-          if(block[i].name == "z") {
-            block[0].status=0;
-            block[2].status=1;
-            block[2].x=block[0].x-0.4*1.5;
-            block[2].y=block[0].y;
-            currX=block[2].x;
-            currY=block[2].y;
-          }
-          else if(block[i].name == "y") {
-            block[1].x-=0.4;
+  MeshHashes hashes() const {
+    MeshHashes hashes;
+    hashes.vertices = hashBytes(this->vertices, 3*this->count*sizeof(GLfloat));
+    hashes.colors = hashBytes(this->colors, 3*this->count*sizeof(GLfloat));
+    hashes.switches = hashBytes(this->switches, this->count);
+    return hashes;
+  }
+};
+
+int chunk_bakes;          // chunks of either board baked this frame
+
+/* The board, indexed tiles[i][j] like the old fixed array. Chunks are
+   baked on demand when they come into view, rebaked when one of their
+   tiles changes and evicted least recently drawn (farthest first on a
+   tie) once the resident chunks exceed CHUNK_BUDGET_BYTES. */
+class Board {
+  public:
+    int width;
+    int height;
+    int chunks_x;
+    int chunks_y;
+    // All three live in the board's arena, see unload()
+    LinearArena* arena;
+    Tiles* tiles;
+    Chunk* chunks;
+    glm::vec3* chunk_centers;
+    int chunk_count;
+    long long resident_bytes;
+    int frame;
+    // Front-to-back chunk orders for the last few camera positions, in
+    // the arena, so the depth test can reject hidden tile fragments
+    // before they are shaded. Chunk centers are fixed, so an order is
+    // only sorted the first time its key is seen.
+    long long order_keys[DRAW_ORDER_SLOTS][MAX_VIEWS];
+    int* orders;
+    int order_slots;
+    int next_order_slot;
+    // Chunk meshes drawn last frame, replayed as they are while the views,
+    // the order and every listed chunk stay the same
+    int* recorded_chunks;
+    VAO** recorded_meshes;
+    int recorded_count;
+    glm::mat4 recorded_VP[MAX_VIEWS];
+    int recorded_views;
+    bool recorded_sort;
+    bool recorded_valid;
+    int recorded_triangles;
+
+    Tiles* operator[](int i) {
+      return &this->tiles[i*this->height];
+    }
+
+    /* Frees the GPU meshes and drops the board storage with its arena */
+    void unload() {
+      for(int i=0;i<this->chunk_count;i++)
+        release(this->chunks[i]);
+      this->tiles=NULL;
+      this->chunks=NULL;
+      this->chunk_centers=NULL;
+      this->chunk_count=0;
+      this->width=0;
+      this->height=0;
+      this->arena->reset();
+    }
+
+    void resize(int width, int height) {
+      int i, j;
+      // Same size keeps the tiles and the baked chunks, see refresh()
+      if(this->tiles && this->width == width && this->height == height)
+        return;
+
+      unload();
+      this->width=width;
+      this->height=height;
+      this->tiles=this->arena->alloc<Tiles>(width*height);
+      for(i=0;i<width*height;i++)
+        this->tiles[i]=Tiles();
+      this->chunks_x=(width+CHUNK_SIZE-1)/CHUNK_SIZE;
+      this->chunks_y=(height+CHUNK_SIZE-1)/CHUNK_SIZE;
+      this->chunk_count=this->chunks_x*this->chunks_y;
+      this->chunks=this->arena->alloc<Chunk>(this->chunk_count);
+      this->chunk_centers=this->arena->alloc<glm::vec3>(this->chunk_count);
+      for(i=0;i<this->chunks_x;i++) {
+        for(j=0;j<this->chunks_y;j++) {
+          Chunk& chunk = this->chunks[i*this->chunks_y+j];
+          chunk.mesh=NULL;
+          chunk.lod_mesh=NULL;
+          chunk.first_x=i*CHUNK_SIZE;
+          chunk.first_y=j*CHUNK_SIZE;
+          chunk.dirty=1;
+          chunk.empty=0;
+          chunk.last_used=-1;
+          chunk.signature=0;
+          chunk.center=glm::vec3(0.4*(chunk.first_x+(CHUNK_SIZE-1)/2.0), 0.4*(chunk.first_y+(CHUNK_SIZE-1)/2.0), 0);
+          this->chunk_centers[i*this->chunks_y+j]=chunk.center;
+        }
+      }
+      this->orders=this->arena->alloc<int>(DRAW_ORDER_SLOTS*this->chunk_count);
+      this->order_slots=0;
+      this->next_order_slot=0;
+      this->recorded_chunks=this->arena->alloc<int>(this->chunk_count);
+      this->recorded_meshes=this->arena->alloc<VAO*>(this->chunk_count);
+      this->recorded_count=0;
+      this->recorded_valid=0;
+    }
+
+    /* One order shared by every view, since the board is a single
+       instanced pass. With split screen it is sorted from the midpoint of
+       the eyes, near enough to front to back for both halves. */
+    const int* drawOrder() {
+      long long key[MAX_VIEWS];
+      glm::vec3 eye(0);
+      int slot, v;
+      for(v=0;v<MAX_VIEWS;v++)
+        key[v] = sort_front_to_back && v < views.count ? views.order_key[v] : -1;
+      for(slot=0;slot<this->order_slots;slot++)
+        if(memcmp(this->order_keys[slot], key, sizeof(key)) == 0)
+          return this->orders + slot*this->chunk_count;
+
+      // Oldest sorted order makes room
+      slot=this->next_order_slot;
+      this->next_order_slot=(slot+1)%DRAW_ORDER_SLOTS;
+      this->order_slots=min(this->order_slots+1, DRAW_ORDER_SLOTS);
+      memcpy(this->order_keys[slot], key, sizeof(key));
+
+      for(v=0;v<views.count;v++)
+        eye += views.eye[v]/(float)views.count;
+      int* order = this->orders + slot*this->chunk_count;
+      const size_t mark = frame_arena.mark();
+      float* dist = frame_arena.alloc<float>(this->chunk_count);
+      for(int i=0;i<this->chunk_count;i++) {
+        glm::vec3 d = this->chunk_centers[i] - eye;
+        dist[i] = glm::dot(d, d);
+        order[i] = i;
+      }
+      // Ties keep array order, like a stable sort but without its buffer
+      if(key[0] != -1)
+        sort(order, order+this->chunk_count, [dist](int a, int b) { return dist[a] < dist[b] || (dist[a] == dist[b] && a < b); });
+      frame_arena.rewind(mark);
+      return order;
+    }
+
+    bool inside(int i, int j) {
+      return i>=0 && j>=0 && i<this->width && j<this->height;
+    }
+
+    Chunk& chunkOf(int i, int j) {
+      return this->chunks[(i/CHUNK_SIZE)*this->chunks_y + j/CHUNK_SIZE];
+    }
+
+    /* Use this instead of writing status directly once a level is running */
+    void setStatus(int i, int j, bool status) {
+      if((*this)[i][j].status != status) {
+        Tiles& tile = (*this)[i][j];
+        tile.status=status;
+        chunkOf(i, j).dirty=1;
+        this->recorded_valid=0;
+        // A disappearing tile crumbles into dust of its own color
+        if(!status)
+          particles.burst(glm::vec3(tile.x, tile.y, 0), glm::vec3(tile.width, tile.length, tile.height), glm::vec3(1, tile.is_fragile, tile.is_bridge), 0.8, 1500);
+      }
+    }
+
+    unsigned tileSignature(const Chunk& chunk) {
+      unsigned hash = 2166136261u;
+      for(int i=chunk.first_x;i<min(chunk.first_x+CHUNK_SIZE, this->width);i++) {
+        for(int j=chunk.first_y;j<min(chunk.first_y+CHUNK_SIZE, this->height);j++) {
+          Tiles& tile = (*this)[i][j];
+          const int key[3] = {tile.status, tile.mesh, tile.is_switch};
+          hash = hashBytes(key, sizeof(key), hash);
+          hash = hashBytes(&tile.x, sizeof(tile.x), hash);
+          hash = hashBytes(&tile.y, sizeof(tile.y), hash);
+        }
+      }
+      return hash;
+    }
+
+    /* After a level was (re)built into the same board: only chunks whose
+       tiles differ from what they were baked from get rebaked, everything
+       else stays on the GPU as it is. Returns the chunks left to bake. */
+    int refresh() {
+      int stale=0;
+      for(int i=0;i<this->chunk_count;i++) {
+        Chunk& chunk = this->chunks[i];
+        if(tileSignature(chunk) != chunk.signature)
+          chunk.dirty=1;
+        stale += chunk.dirty;
+      }
+      this->recorded_valid=0;
+      return stale;
+    }
+
+    void release(VAO*& mesh) {
+      if(mesh)
+        destroy3DObject(mesh);
+      mesh=NULL;
+    }
+
+    void release(Chunk& chunk) {
+      this->recorded_valid=0;
+      if(chunk.mesh) {
+        release(chunk.mesh);
+        release(chunk.lod_mesh);
+        this->resident_bytes-=chunk.bytes;
+      }
+    }
+
+    /* Merges runs of equal tiles into as few top quads as possible: grow
+       each quad along j while the tile matches, then along i while the
+       whole run matches. Sides are dropped, they are sub-pixel from afar. */
+    void greedyMesh(Chunk& chunk, ChunkStaging& staging) {
+      const int size_x = min(CHUNK_SIZE, this->width-chunk.first_x);
+      const int size_y = min(CHUNK_SIZE, this->height-chunk.first_y);
+      int kind[CHUNK_SIZE][CHUNK_SIZE];
+      int i, j, k, w, h;
+
+      // 0 is a hole, otherwise mesh and switch flag, which decide the top
+      for(i=0;i<size_x;i++) {
+        for(j=0;j<size_y;j++) {
+          Tiles& tile = (*this)[chunk.first_x+i][chunk.first_y+j];
+          kind[i][j] = tile.status ? 1 + tile.mesh + 4*tile.is_switch : 0;
+        }
+      }
+
+      for(i=0;i<size_x;i++) {
+        for(j=0;j<size_y;j++) {
+          int type = kind[i][j];
+          if(!type)
+            continue;
+          for(h=1;j+h<size_y && kind[i][j+h]==type;h++);
+          for(w=1;i+w<size_x;w++) {
+            for(k=0;k<h && kind[i+w][j+k]==type;k++);
+            if(k<h)
+              break;
+          }
+          for(int a=0;a<w;a++)
+            for(k=0;k<h;k++)
+              kind[i+a][j+k]=0;
+
+          // Same corner order and shading as face 1 of the tile cuboid
+          Tiles& first = (*this)[chunk.first_x+i][chunk.first_y+j];
+          Tiles& last = (*this)[chunk.first_x+i+w-1][chunk.first_y+j+h-1];
+          const float x0=first.x-first.width/2, x1=last.x+last.width/2;
+          const float y0=first.y-first.length/2, y1=last.y+last.length/2;
+          const float z=first.height/2;
+          const float corners[6][2] = {{x1, y1}, {x1, y0}, {x0, y0}, {x0, y0}, {x0, y1}, {x1, y1}};
+          const CuboidMesh& body = tile_meshes[first.mesh];
+          for(k=0;k<6;k++) {
+            GLfloat* vertex = staging.vertices + 3*staging.count;
+            vertex[0]=corners[k][0];
+            vertex[1]=corners[k][1];
+            vertex[2]=z;
+            staging.switches[staging.count]=first.is_switch ? 255 : 0;
+            staging.count++;
+          }
+          memcpy(staging.colors + 3*(staging.count-6), body.colors, 6*3*sizeof(GLfloat));
+        }
+      }
+    }
+
+    void bake(Chunk& chunk) {
+      chunk_bakes++;
+      // Room for every tile of a full chunk, given back once uploaded
+      const size_t staging_mark = frame_arena.mark();
+      ChunkStaging staging;
+      staging.create(CHUNK_SIZE*CHUNK_SIZE*36);
+      int i, j, k;
+
+      for(i=chunk.first_x;i<min(chunk.first_x+CHUNK_SIZE, this->width);i++) {
+        for(j=chunk.first_y;j<min(chunk.first_y+CHUNK_SIZE, this->height);j++) {
+          Tiles& tile = (*this)[i][j];
+          if(!tile.status)
+            continue;
+          const CuboidMesh& body = tile_meshes[tile.mesh];
+          GLfloat* vertex = staging.vertices + 3*staging.count;
+          for(k=0;k<36;k++) {
+            vertex[3*k]=body.vertices[3*k]+tile.x;
+            vertex[3*k+1]=body.vertices[3*k+1]+tile.y;
+            vertex[3*k+2]=body.vertices[3*k+2];
+          }
+          memcpy(staging.colors + 3*staging.count, body.colors, 36*3*sizeof(GLfloat));
+          // The switch cross is drawn by Tile_GL.frag
+          memset(staging.switches + staging.count, tile.is_switch ? 255 : 0, 36);
+          staging.count+=36;
+        }
+      }
+
+      chunk.dirty=0;
+      chunk.signature=tileSignature(chunk);
+      chunk.empty=!staging.count;
+      if(chunk.empty) {
+        release(chunk);
+        frame_arena.rewind(staging_mark);
+        return;
+      }
+      if(chunk.mesh)
+        this->resident_bytes-=chunk.bytes;
+      this->recorded_valid=0;
+      chunk.bytes = refill(chunk.mesh, chunk.hashes, staging);
+
+      staging.count=0;
+      greedyMesh(chunk, staging);
+      chunk.bytes += refill(chunk.lod_mesh, chunk.lod_hashes, staging);
+      this->resident_bytes+=chunk.bytes;
+      frame_arena.rewind(staging_mark);
+    }
+
+    /* Puts staged data into mesh. A mesh with the same vertex count keeps
+       its VAO and buffers and only the buffers whose data changed are
+       rewritten, otherwise the buffers are respecified. Returns the mesh's
+       bytes. */
+    int refill(VAO*& mesh, MeshHashes& hashes, const ChunkStaging& staging) {
+      MeshHashes fresh = staging.hashes();
+      if(mesh && mesh->NumVertices == staging.count) {
+        if(fresh.vertices != hashes.vertices)
+          updateVertexBuffer(mesh->VertexBuffer, staging.vertices, 3*staging.count*sizeof(GLfloat));
+        if(fresh.colors != hashes.colors)
+          updateVertexBuffer(mesh->ColorBuffer, staging.colors, 3*staging.count*sizeof(GLfloat));
+        if(fresh.switches != hashes.switches)
+          updateVertexBuffer(mesh->DecalBuffer, staging.switches, staging.count);
+      }
+      else if(mesh)
+        respecify3DObject(mesh, staging.count, staging.vertices, staging.colors, staging.switches);
+      else {
+        mesh = create3DObject(MEM_BOARD, GL_TRIANGLES, staging.count, staging.vertices, staging.colors, GL_FILL);
+        addDecalBuffer(mesh, staging.switches);
+      }
+      hashes=fresh;
+      return staging.bytes();
+    }
+
+    /* Clip space test of the chunk's bounding box against the frustum */
+    bool visible(const Chunk& chunk, const glm::mat4& VP, const glm::vec3& eye) {
+      glm::vec3 d = chunk.center - eye;
+      if(d.x*d.x + d.y*d.y > CHUNK_DRAW_DISTANCE*CHUNK_DRAW_DISTANCE)
+        return 0;
+
+      float half = 0.4*CHUNK_SIZE/2;
+      int outside[6] = {0, 0, 0, 0, 0, 0};
+      for(int k=0;k<8;k++) {
+        glm::vec4 p = VP * glm::vec4(chunk.center.x + ((k&1) ? half : -half), chunk.center.y + ((k&2) ? half : -half), (k&4) ? 0.1 : -0.1, 1);
+        outside[0] += p.x < -p.w;
+        outside[1] += p.x > p.w;
+        outside[2] += p.y < -p.w;
+        outside[3] += p.y > p.w;
+        outside[4] += p.z < -p.w;
+        outside[5] += p.z > p.w;
+      }
+      for(int k=0;k<6;k++)
+        if(outside[k] == 8)
+          return 0;
+      return 1;
+    }
+
+    bool canReplay() {
+      return record_board_draws && this->recorded_valid && this->recorded_views == views.count &&
+             this->recorded_sort == sort_front_to_back &&
+             memcmp(this->recorded_VP, views.VP, views.count*sizeof(glm::mat4)) == 0;
+    }
+
+    /* Draws every chunk visible from any view, instanced once per view */
+    void draw() {
+      int k, v, bakes=0, triangles=0;
+      bool complete=1;
+      this->frame++;
+
+      // Tile vertices are baked in world space, so every chunk uses VP
+      glUseProgram (tileProgramID);
+      uploadViews(TileShader.VP, TileShader.views);
+
+      // Nothing moved and no chunk changed, skip culling, ordering and LOD
+      if(canReplay()) {
+        for(k=0;k<this->recorded_count;k++) {
+          this->chunks[this->recorded_chunks[k]].last_used=this->frame;
+          draw3DObject(this->recorded_meshes[k], views.count);
+        }
+        overdraw.triangles=this->recorded_triangles;
+        glUseProgram (programID);
+        return;
+      }
+      this->recorded_count=0;
+
+      // Nearest chunks first so the far ones fail the early depth test
+      const int* order = drawOrder();
+      for(k=0;k<this->chunk_count;k++) {
+        Chunk& chunk = this->chunks[order[k]];
+        float dist = CHUNK_DRAW_DISTANCE;
+        bool seen = 0;
+        for(v=0;v<views.count;v++) {
+          if(visible(chunk, views.VP[v], views.eye[v])) {
+            seen = 1;
+            dist = min(dist, glm::distance(chunk.center, views.eye[v]));
+          }
+        }
+        if(!seen)
+          continue;
+        if(chunk.dirty || (!chunk.mesh && !chunk.empty)) {
+          if(bakes < CHUNK_BAKES_PER_FRAME) {
+            bake(chunk);
+            bakes++;
+          }
+          else
+            complete=0;
+        }
+        if(chunk.mesh) {
+          chunk.last_used=this->frame;
+          // Distant chunks switch to the merged tops
+          VAO* mesh = dist > CHUNK_LOD_DISTANCE ? chunk.lod_mesh : chunk.mesh;
+          draw3DObject(mesh, views.count);
+          triangles += views.count*mesh->NumVertices/3;
+          this->recorded_chunks[this->recorded_count]=order[k];
+          this->recorded_meshes[this->recorded_count]=mesh;
+          this->recorded_count++;
+        }
+      }
+      overdraw.triangles=triangles;
+      glUseProgram (programID);
+
+      evict();
+
+      // Chunks still waiting for a bake keep the list from being replayed
+      memcpy(this->recorded_VP, views.VP, views.count*sizeof(glm::mat4));
+      this->recorded_views=views.count;
+      this->recorded_sort=sort_front_to_back;
+      this->recorded_triangles=triangles;
+      this->recorded_valid=complete;
+    }
+
+    void evict() {
+      while(this->resident_bytes > CHUNK_BUDGET_BYTES) {
+        Chunk* victim=NULL;
+        float victim_dist=0;
+        for(int k=0;k<this->chunk_count;k++) {
+          Chunk& chunk = this->chunks[k];
+          if(!chunk.mesh || chunk.last_used == this->frame)
+            continue;
+          // Nearest eye, a chunk close to either player is worth keeping
+          float dist = glm::distance(chunk.center, views.eye[0]);
+          for(int v=1;v<views.count;v++)
+            dist = min(dist, glm::distance(chunk.center, views.eye[v]));
+          if(!victim || chunk.last_used < victim->last_used || (chunk.last_used == victim->last_used && dist > victim_dist)) {
+            victim=&chunk;
+            victim_dist=dist;
+          }
+        }
+        if(!victim)
+          return;
+        release(*victim);
+        victim->dirty=1;
+      }
+    }
+
+    /* Bakes up to budget chunks for a board that is not drawn yet, the
+       nearest to start first, until CHUNK_PREFETCH_BYTES are resident.
+       Chunks out of draw distance of start are left for draw(). Returns
+       how many were baked. */
+    int prebake(int budget, const glm::vec3& start) {
+      int baked=0;
+      while(baked < budget && this->resident_bytes < CHUNK_PREFETCH_BYTES) {
+        Chunk* next=NULL;
+        float next_dist=CHUNK_DRAW_DISTANCE;
+        for(int k=0;k<this->chunk_count;k++) {
+          Chunk& chunk = this->chunks[k];
+          if(!chunk.dirty && (chunk.mesh || chunk.empty))
+            continue;
+          float dist = glm::distance(chunk.center, start);
+          if(dist <= next_dist) {
+            next=&chunk;
+            next_dist=dist;
+          }
+        }
+        if(!next)
+          break;
+        bake(*next);
+        baked++;
+      }
+      return baked;
+    }
+
+    /* Brings a board that is not drawn yet, still holding the meshes of
+       the level it had before, back within what prebake() would leave:
+       chunks out of reach of start go first, then the farthest ones until
+       CHUNK_PREFETCH_BYTES fit. */
+    void trim(const glm::vec3& start) {
+      while(1) {
+        Chunk* victim=NULL;
+        float victim_dist=0;
+        for(int k=0;k<this->chunk_count;k++) {
+          Chunk& chunk = this->chunks[k];
+          if(!chunk.mesh)
+            continue;
+          float dist = glm::distance(chunk.center, start);
+          if(dist > victim_dist) {
+            victim=&chunk;
+            victim_dist=dist;
+          }
+        }
+        if(!victim || (victim_dist <= CHUNK_DRAW_DISTANCE && this->resident_bytes <= CHUNK_PREFETCH_BYTES))
+          return;
+        release(*victim);
+        victim->dirty=1;
+      }
+    }
+};
+
+class Block {
+  public:
+    const StaticMesh* body;
+    float width;
+    float height;
+    float length;
+    float x;
+    float y;
+    float z;
+    bool status;
+    bool standing;
+    bool rotate_status;
+    bool left;
+    bool right;
+    bool up;
+    bool down;
+    BlockName name;
+    // Current roll, evaluated in Block_GL.vert
+    glm::vec3 pivot;
+    glm::vec3 pivot_back;
+    glm::vec3 roll_axis;
+    float roll_angle;
+    float roll_start;
+
+    void create(BlockName name) {
+
+      this->name=name;
+      this->width=block_shapes[name].width;
+      this->length=block_shapes[name].length;
+      this->height=block_shapes[name].height;
+      if(name == BLOCK_Z)
+        this->status=1;
+      else
+        this->status=0;
+      this->standing=1;
+      this->x=0;
+      this->y=0;
+      this->z=0;
+      this->right=0;
+      this->left=0;
+      this->up=0;
+      this->down=0;
+      this->rotate_status=0;
+      this->stopRoll();
+
+      this->body = &block_bodies[name];
+
+    }
+
+    /* Back to resting on the block's center, no rotation */
+    void stopRoll() {
+      this->pivot = glm::vec3(0, 0, this->height/2);
+      this->pivot_back = glm::vec3(0, 0, 0.1);
+      this->roll_axis = glm::vec3(1, 0, 0);
+      this->roll_angle=0;
+      this->roll_start=0;
+      block_anim_dirty=1;
+    }
+
+    bool rollDone() {
+      return getGameTime() - this->roll_start >= ROLL_DURATION;
+    }
+
+    void revolve_block(Move move) {
+      if(!this->rotate_status) {
+        total_score++;
+        updateScore(-3, 0);
+        if(this->standing)
+          this->standing=0;
+        else
+          this->standing=1;
+        if(move == MOVE_LEFT) {
+          this->left=1;
+          this->pivot = glm::vec3(this->width/2, 0, this->height/2);
+          this->pivot_back = glm::vec3(-this->width/2, 0, 0.1);
+          this->roll_axis = glm::vec3(0, 1, 0);
+          this->roll_angle = -M_PI/2;
+        }
+        else if(move == MOVE_RIGHT) {
+          this->right=1;
+          this->pivot = glm::vec3(-this->width/2, 0, this->height/2);
+          this->pivot_back = glm::vec3(this->width/2, 0, 0.1);
+          this->roll_axis = glm::vec3(0, 1, 0);
+          this->roll_angle = M_PI/2;
+        }
+        else if(move == MOVE_UP) {
+          this->up=1;
+          this->pivot = glm::vec3(0, -this->length/2, this->height/2);
+          this->pivot_back = glm::vec3(0, this->length/2, 0.1);
+          this->roll_axis = glm::vec3(1, 0, 0);
+          this->roll_angle = -M_PI/2;
+        }
+        else {
+          this->down=1;
+          this->pivot = glm::vec3(0, this->length/2, this->height/2);
+          this->pivot_back = glm::vec3(0, -this->length/2, 0.1);
+          this->roll_axis = glm::vec3(1, 0, 0);
+          this->roll_angle = M_PI/2;
+        }
+        //changeAxis();
+        this->roll_start=getGameTime();
+        this->rotate_status=1;
+        block_anim_dirty=1;
+      }
+
+    }
+};
+
+Board tiles;
+// The level after the current one, built and baked ahead while playing
+Board upcoming;
+int upcoming_level;
+
+Block block[3];
+
+int currLevel, built_level;
+
+/* Everything that belongs to one player. The game logic works on the
+   globals above, usePlayer() swaps a player's state in and out of them
+   so the single player code runs unchanged for each player in turn. */
+struct Player {
+  Block block[3];
+  Camera camera;
+  float currX, currY;
+  int currIndexX, currIndexY;
+  float currAxis[3];
+  bool X_POS, X_NEG, Y_POS, Y_NEG, vert_fall;
+  int DYING;
+  float fall_start;
+  int total_score;
+
+  void save() {
+    copy(::block, ::block+3, this->block);
+    this->camera=::camera;
+    this->currX=::currX;
+    this->currY=::currY;
+    this->currIndexX=::currIndexX;
+    this->currIndexY=::currIndexY;
+    copy(::currAxis, ::currAxis+3, this->currAxis);
+    this->X_POS=::X_POS;
+    this->X_NEG=::X_NEG;
+    this->Y_POS=::Y_POS;
+    this->Y_NEG=::Y_NEG;
+    this->vert_fall=::vert_fall;
+    this->DYING=::DYING;
+    this->fall_start=::fall_start;
+    this->total_score=::total_score;
+  }
+
+  void load() {
+    copy(this->block, this->block+3, ::block);
+    ::camera=this->camera;
+    ::currX=this->currX;
+    ::currY=this->currY;
+    ::currIndexX=this->currIndexX;
+    ::currIndexY=this->currIndexY;
+    copy(this->currAxis, this->currAxis+3, ::currAxis);
+    ::X_POS=this->X_POS;
+    ::X_NEG=this->X_NEG;
+    ::Y_POS=this->Y_POS;
+    ::Y_NEG=this->Y_NEG;
+    ::vert_fall=this->vert_fall;
+    ::DYING=this->DYING;
+    ::fall_start=this->fall_start;
+    ::total_score=this->total_score;
+    // Both players share the block uniforms
+    ::block_anim_dirty=1;
+  }
+};
+
+Player players[2];
+
+void usePlayer(int p) {
+  if(p == active_player)
+    return;
+  players[active_player].save();
+  players[p].load();
+  active_player=p;
+}
+
+void getCurrIndex() {
+  int i;
+  for(i=0;i<3;i++) {
+    if(block[i].name == BLOCK_Z&&block[i].status==1) {
+      currIndexX=currX/0.4;
+      currIndexY=currY/0.4;
+    }
+  }
+}
+
+void rotate_block() {
+  int i;
+  for(i=0;i<3;i++) {
+    if(block[i].rotate_status) {
+      if(block[i].left) {
+        if(block[i].rollDone()) {
+          Y_NEG=1;
+          Y_POS=0;
+          X_POS=0;
+          X_NEG=0;
+          block[i].rotate_status=0;
+          block[i].left=0;
+          block[i].stopRoll();
+          if(block[i].name == BLOCK_Z) {
+            block[0].status=0;
+            block[2].status=1;
+            block[2].x=block[0].x-0.4*1.5;
+            block[2].y=block[0].y;
+            currX=block[2].x;
+            currY=block[2].y;
+          }
+          else if(block[i].name == BLOCK_Y) {
+            block[1].x-=0.4;
             currX=block[1].x;
             currY=block[1].y;
           }
@@ -1064,18 +2671,15 @@ void rotate_block() {
         }
       }
       else if(block[i].right) {
-        block[i].rotate_angle_y+=3;
-        if(block[i].rotate_angle_y>=91) {
+        if(block[i].rollDone()) {
           Y_POS=1;
           Y_NEG=0;
           X_NEG=0;
           X_POS=0;
           block[i].rotate_status=0;
           block[i].right=0;
-          block[i].rotate_angle_y=0;
-          block[i].tempTranslate = glm::translate (glm::vec3(0, 0, block[i].height/2));
-          block[i].invTempTranslate=glm::translate (glm::vec3(0, 0, 0.1));
-          if(block[i].name == "z") {
+          block[i].stopRoll();
+          if(block[i].name == BLOCK_Z) {
             block[0].status=0;
             block[2].status=1;
             block[2].x=block[0].x+0.4*1.5;
@@ -1083,7 +2687,7 @@ void rotate_block() {
             currX=block[2].x;
             currY=block[2].y;
           }
-          else if(block[i].name == "y") {
+          else if(block[i].name == BLOCK_Y) {
             block[1].x+=0.4;
             currX=block[1].x;
             currY=block[1].y;
@@ -1099,18 +2703,15 @@ void rotate_block() {
         }
       }
       else if(block[i].up) {
-        block[i].rotate_angle_x-=3;
-        if(block[i].rotate_angle_x<=-91) {
+        if(block[i].rollDone()) {
           X_NEG=1;
           X_POS=0;
           Y_POS=0;
           Y_NEG=0;
           block[i].rotate_status=0;
           block[i].up=0;
-          block[i].rotate_angle_x=0;
-          block[i].tempTranslate = glm::translate (glm::vec3(0, 0, block[i].height/2));
-          block[i].invTempTranslate=glm::translate (glm::vec3(0, 0, 0.1));
-          if(block[i].name == "z") {
+          block[i].stopRoll();
+          if(block[i].name == BLOCK_Z) {
             block[0].status=0;
             block[1].status=1;
             block[1].x=block[0].x;
@@ -1118,7 +2719,7 @@ void rotate_block() {
             currX=block[1].x;
             currY=block[1].y;
           }
-          else if(block[i].name == "x") {
+          else if(block[i].name == BLOCK_X) {
             block[2].y+=0.4;
             currX=block[2].x;
             currY=block[2].y;
@@ -1134,18 +2735,15 @@ void rotate_block() {
         }
       }
       else if(block[i].down) {
-        block[i].rotate_angle_x+=3;
-        if(block[i].rotate_angle_x>=91) {
+        if(block[i].rollDone()) {
           X_POS=1;
           X_NEG=0;
           Y_POS=0;
           Y_NEG=0;
           block[i].rotate_status=0;
           block[i].down=0;
-          block[i].rotate_angle_x=0;
-          block[i].tempTranslate = glm::translate (glm::vec3(0, 0, block[i].height/2));
-          block[i].invTempTranslate=glm::translate (glm::vec3(0, 0, 0.1));
-          if(block[i].name == "z") {
+          block[i].stopRoll();
+          if(block[i].name == BLOCK_Z) {
             block[0].status=0;
             block[1].status=1;
             block[1].x=block[0].x;
@@ -1153,7 +2751,7 @@ void rotate_block() {
             currX=block[1].x;
             currY=block[1].y;
           }
-          else if(block[i].name == "x") {
+          else if(block[i].name == BLOCK_X) {
             block[2].y-=0.4;
             currX=block[2].x;
             currY=block[2].y;
@@ -1180,31 +2778,61 @@ bool isOnTile(int i, int j) {
     return 0;
 }
 
-string getCurrBlock () {
+BlockName getCurrBlock () {
   int i;
   for(i=0;i<3;i++) {
     if(block[i].status) {
       return(block[i].name);
     }
   }
+  return BLOCK_Z;
+}
+
+/* Sends the active block's placement, roll and fall to Block_GL.vert */
+void uploadBlockAnimation(Block& current) {
+  glUniform3f(BlockShader.position, current.x, current.y, current.z);
+  glUniform3fv(BlockShader.pivot, 1, &current.pivot[0]);
+  glUniform3fv(BlockShader.pivotBack, 1, &current.pivot_back[0]);
+  glUniform3fv(BlockShader.rollAxis, 1, &current.roll_axis[0]);
+  glUniform1f(BlockShader.rollAngle, current.roll_angle);
+  glUniform1f(BlockShader.rollStart, current.roll_start);
+  glUniform1f(BlockShader.rollDuration, current.rotate_status ? ROLL_DURATION : 0);
+
+  // Falling over keeps spinning the way the last roll went
+  glm::vec3 fall_axis(1, 0, 0);
+  float fall_spin=0;
+  if(DYING&&!vert_fall) {
+    if(Y_NEG) {
+      fall_axis = glm::vec3(0, 1, 0);
+      fall_spin = -FALL_SPIN;
+    }
+    else if(X_POS) {
+      fall_spin = FALL_SPIN;
+    }
+    else if(Y_POS) {
+      fall_axis = glm::vec3(0, 1, 0);
+      fall_spin = FALL_SPIN;
+    }
+    else if(X_NEG) {
+      fall_spin = -FALL_SPIN;
+    }
+  }
+  glUniform1f(BlockShader.fallStart, DYING ? fall_start : -1);
+  glUniform1f(BlockShader.fallSpeed, FALL_SPEED);
+  glUniform3fv(BlockShader.fallAxis, 1, &fall_axis[0]);
+  glUniform1f(BlockShader.fallSpin, fall_spin);
+
+  block_anim_dirty=0;
 }
 
 /* Render the scene with openGL */
 /* Edit this function according to your assignment */
 void draw (GLFWwindow* window, bool draw_screen)
 {
-  GLfloat fov = M_PI/2;
-
   camera_rotation_angle=90;
 
   glClearColor (0.0f, 0.0f, 0.0f, 0.0f); // R, G, B, A
   glClearDepth (1.0f);
-  // Eye - Location of camera. Don't change unless you are sure!!
-  // glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f)-1, -1, 5*sin(camera_rotation_angle*M_PI/180.0f-1) );
-  // Target - Where is the camera looking at.  Don't change unless you are sure!!
-  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-
-    //glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   if(draw_screen) {
 
@@ -1215,84 +2843,37 @@ void draw (GLFWwindow* window, bool draw_screen)
     // Don't change unless you know what you are doing
     glUseProgram (programID);
 
-    int window_width=800, window_height=(0.8*600);
-
-    glfwGetFramebufferSize(window, &window_width, &window_height);
-
-    glViewport (0, 0, (GLsizei) 800, (GLsizei) (0.8*600));
-
-    // Perspective projection for 3D views
-    Matrices.projection = glm::perspective (fov, (GLfloat) (800) / (GLfloat) (0.8*600), 0.1f, 500.0f);
+    // Split screen views share one viewport, the shaders place each half
+    glViewport (0, 0, (GLsizei) views.screen_width, (GLsizei) views.screen_height);
 
     float mouse_change_x, mouse_change_y;
 
     if(mouse_hit) {
-      top_view=1;
-      tower_view=0;
-      level_view=0;
-      block_view=0;
-      front_view=0;
+      camera.setMode(TOP_VIEW);
       mouse_change_x=changeMouseInX();
       mouse_change_y=changeMouseInY();
       target_mouse_x+=mouse_change_x;
       target_mouse_y+=mouse_change_y;
     }
 
-    if(top_view) {
-      glm::vec3 eye(0.4*5, 0.4*5, 5+mouse_yoffset);
-      glm::vec3 up (0, 1, 0);
-      glm::vec3 target (target_mouse_x, target_mouse_y, 0);
-      Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-    }
-    else if(tower_view) {
-      glm::vec3 eye(-1, -1, 4);
-      glm::vec3 up (1, 1, 0);
-      glm::vec3 target (0.4*5, 0.4*5, 0);
-      Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-    }
-    else if(level_view) {
-      glm::vec3 eye(0.4*5, -0.4*5, 2);
-      glm::vec3 up (0, 1, 0);
-      glm::vec3 target (0.4*5, 0.4*5, 0);
-      Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-    }
-    else if(block_view) {
-      if(getAxis() == "x") {
-        glm::vec3 eye(currX-1.5, currY, 3.5);
-        glm::vec3 up (0, 0, 1);
-        glm::vec3 target (currX+0.4*10, currY, 1);
-        Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-      }
-      else {
-        glm::vec3 eye(currX, currY-1.5, 3.5);
-        glm::vec3 up (0, 0, 1);
-        glm::vec3 target (currX, currY+0.4*10, 1);
-        Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-      }
-    }
-    else if(front_view){
-      if(getAxis() == "x") {
-        glm::vec3 eye(currX+0.4, currY, 1.5);
-        glm::vec3 up (0, 0, 1);
-        glm::vec3 target (currX+0.4*5, currY, 0);
-        Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-      }
-      else {
-        glm::vec3 eye(currX, currY+0.4, 1.5);
-        glm::vec3 up (0, 0, 1);
-        glm::vec3 target (currX, currY+0.4*5, 0);
-        Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-      }
+    int p;
+    for(p=0;p<player_count;p++) {
+      usePlayer(p);
+      camera.setViewport(views.screen_width/views.count, views.screen_height);
+      camera.setTarget(target_mouse_x, target_mouse_y, mouse_yoffset);
+      camera.setFollow(currX, currY, currAxis[0]==1);
+
+      // View and projection are only rebuilt when one of the inputs above changed
+      views.VP[p] = camera.getVP();
+      views.eye[p] = camera.eye;
+      views.order_key[p] = camera.orderKey();
     }
+    usePlayer(0);
 
-    // Compute Camera matrix (view)
-    //Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-    //  Don't change unless you are sure!!
-    //Matrices.view = glm::lookAt(glm::vec3(-1,-1,1), glm::vec3(0,0,0), glm::vec3(1,1,2)); // Fixed camera for 2D (ortho) in XY plane
-
-    // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-    //  Don't change unless you are sure!!
-    glm::mat4 VP = Matrices.projection * Matrices.view;
+    if(views.count > 1) {
+      glEnable(GL_CLIP_DISTANCE0);
+      glEnable(GL_CLIP_DISTANCE1);
+    }
 
     // Send our tr\ansformation to the currently bound shader, in the "MVP" uniform
     // For each model you render, since the MVP will be different (at least the M part)
@@ -1303,59 +2884,49 @@ void draw (GLFWwindow* window, bool draw_screen)
     Matrices.model = glm::mat4(1.0f);
 
     /* Render your scene */
-    int i, j;
-
-    for(i=0;i<3;i++) {
-      if(block[i].status) {
-        Matrices.model = glm::mat4(1.0f);
-        if(DYING&&!vert_fall) {
-          if(Y_NEG) {
-            block[i].rotate_angle_y -= DYING_rot;
-          }
-          else if(X_POS) {
-            block[i].rotate_angle_x += DYING_rot;
-          }
-          else if(Y_POS) {
-            block[i].rotate_angle_y += DYING_rot;
-          }
-          else if(X_NEG) {
-            block[i].rotate_angle_x -= DYING_rot;
-          }
+    int i;
+
+    // The roll and the fall are evaluated in Block_GL.vert, the CPU only
+    // uploads new parameters when an animation starts or the block changes.
+    // Each player sees both blocks.
+    glUseProgram (blockProgramID);
+    uploadViews(BlockShader.VP, BlockShader.views);
+    glUniform1f(BlockShader.time, getGameTime());
+
+    for(p=player_count-1;p>=0;p--) {
+      usePlayer(p);
+      for(i=0;i<3;i++) {
+        if(block[i].status) {
+          if(block_anim_dirty)
+            uploadBlockAnimation(block[i]);
+          drawStaticMesh(block[i].body, views.count);
         }
-        glm::mat4 translateBlock = glm::translate (glm::vec3(block[i].x, block[i].y, block[i].z-DYING_inc));        // glTranslatef
-        glm::mat4 rotateBlockX = glm::rotate((float)(block[i].rotate_angle_x*M_PI/180.0f), glm::vec3(1,0,0));
-        glm::mat4 rotateBlockY = glm::rotate((float)(block[i].rotate_angle_y*M_PI/180.0f), glm::vec3(0,1,0));
-        Matrices.model *= (block[i].invTempTranslate*translateBlock*rotateBlockX*rotateBlockY*block[i].tempTranslate);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(block[i].body);
       }
+      rotate_block();
     }
 
-    rotate_block();
+    glUseProgram (programID);
+
+    beginOverdrawQuery();
 
-    if(DYING != 0) {
-      DYING_inc+=0.08;
+    chrono::steady_clock::time_point submit_start = chrono::steady_clock::now();
+    tiles.draw();
+    if(overdraw.enabled) {
+      overdraw.submit_us += chrono::duration<double, micro>(chrono::steady_clock::now()-submit_start).count();
+      overdraw.submits++;
     }
 
-    glm::mat4 translateTile;
-      
-    for(i=0;i<10;i++) {
-      for(j=0;j<10;j++) {
-        if(tiles[i][j].status) {
-          Matrices.model = glm::mat4(1.0f);
-          translateTile = glm::translate (glm::vec3(tiles[i][j].x, tiles[i][j].y, 0));        // glTranslatef
-          Matrices.model *= (translateTile);
-          MVP = VP * Matrices.model;
-          glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-          draw3DObject(tiles[i][j].body);
+    endOverdrawQuery();
 
-          if(tiles[i][j].is_switch) {
-            draw3DObject(tiles[i][j].line_1);
-            draw3DObject(tiles[i][j].line_2);
-          }
-        }
-      }
+    // Simulated and drawn without reading anything back to the CPU
+    particles.update();
+    particles.draw(camera.projection, camera.viewport_height);
+    glUseProgram (programID);
+
+    // The HUD shader does not write clip distances
+    if(views.count > 1) {
+      glDisable(GL_CLIP_DISTANCE0);
+      glDisable(GL_CLIP_DISTANCE1);
     }
   }
   else {
@@ -1375,17 +2946,8 @@ void draw (GLFWwindow* window, bool draw_screen)
     // sets the viewport of openGL renderer
     glViewport (0, (int)(0.8*window_height), (int)(window_width), (int)(0.2*window_height));
 
-    // Ortho projection for 2D views
-    Matrices.projection = glm::ortho(-4.0f, 4.0f, -0.7f, 0.7f, 0.1f, 500.0f);
-
-    // Compute Camera matrix (view)
-    //Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-    //  Don't change unless you are sure!!
-    Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-    // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-    //  Don't change unless you are sure!!
-    glm::mat4 VP = Matrices.projection * Matrices.view;
+    // Ortho projection and fixed camera for the 2D HUD, cached by the camera
+    const glm::mat4& VP = camera.hud_VP;
 
     // Send our tr\ansformation to the currently bound shader, in the "MVP" uniform
     // For each model you render, since the MVP will be different (at least the M part)
@@ -1396,63 +2958,27 @@ void draw (GLFWwindow* window, bool draw_screen)
 
     int i;
 
-    for(i=0;i<4;i++) {
-      if(score_board[i].A) {
-        Matrices.model = glm::mat4(1.0f);
-        glm::mat4 translateA = glm::translate (glm::vec3(score_board[i].x_shift, score_board[i].y_shift, 0));
-        Matrices.model *= (translateA);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(score_board[i].a);
-      }
-      if(score_board[i].B) {
-        Matrices.model = glm::mat4(1.0f);
-        glm::mat4 translateB = glm::translate (glm::vec3(score_board[i].x_shift, score_board[i].y_shift, 0));
-        Matrices.model *= (translateB);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(score_board[i].b);
-      }
-      if(score_board[i].C) {
-        Matrices.model = glm::mat4(1.0f);
-        glm::mat4 translateC = glm::translate (glm::vec3(score_board[i].x_shift, score_board[i].y_shift, 0));
-        Matrices.model *= (translateC);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(score_board[i].c);
-      }
-      if(score_board[i].D) {
-        Matrices.model = glm::mat4(1.0f);
-        glm::mat4 translateD = glm::translate (glm::vec3(score_board[i].x_shift, score_board[i].y_shift, 0));
-        Matrices.model *= (translateD);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(score_board[i].d);
-      }
-      if(score_board[i].E) {
-        Matrices.model = glm::mat4(1.0f);
-        glm::mat4 translateE = glm::translate (glm::vec3(score_board[i].x_shift, score_board[i].y_shift, 0));
-        Matrices.model *= (translateE);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(score_board[i].e);
-      }
-      if(score_board[i].F) {
-        Matrices.model = glm::mat4(1.0f);
-        glm::mat4 translateF = glm::translate (glm::vec3(score_board[i].x_shift, score_board[i].y_shift, 0));
-        Matrices.model *= (translateF);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(score_board[i].f);
-      }
-      if(score_board[i].G) {
-        Matrices.model = glm::mat4(1.0f);
-        glm::mat4 translateG = glm::translate (glm::vec3(score_board[i].x_shift, score_board[i].y_shift, 0));
-        Matrices.model *= (translateG);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(score_board[i].g);
-      }
+    for(i=0;i<HUD_DIGITS;i++)
+      hud_transforms.set(i, score_board[i].x_shift, score_board[i].y_shift, 0);
+    hud_transforms.compute(VP);
+
+    for(i=0;i<HUD_DIGITS;i++) {
+      // All seven segments of a digit share the digit's translation
+      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &hud_transforms.MVP[i][0][0]);
+      if(score_board[i].A)
+        drawStaticMesh(score_board[i].a);
+      if(score_board[i].B)
+        drawStaticMesh(score_board[i].b);
+      if(score_board[i].C)
+        drawStaticMesh(score_board[i].c);
+      if(score_board[i].D)
+        drawStaticMesh(score_board[i].d);
+      if(score_board[i].E)
+        drawStaticMesh(score_board[i].e);
+      if(score_board[i].F)
+        drawStaticMesh(score_board[i].f);
+      if(score_board[i].G)
+        drawStaticMesh(score_board[i].g);
     }
   }
 
@@ -1487,6 +3013,15 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
         }
     }
     else if (action == GLFW_PRESS) {
+        // The second player steers with WASD, mapped onto the arrow keys
+        if(player_count > 1) {
+            int arrow = key == GLFW_KEY_W ? GLFW_KEY_UP : key == GLFW_KEY_S ? GLFW_KEY_DOWN :
+                        key == GLFW_KEY_A ? GLFW_KEY_LEFT : key == GLFW_KEY_D ? GLFW_KEY_RIGHT : 0;
+            if(arrow) {
+                usePlayer(1);
+                key=arrow;
+            }
+        }
         switch (key) {
             case GLFW_KEY_ESCAPE:
                 quit(window);
@@ -1494,325 +3029,1470 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
             case GLFW_KEY_LEFT:
                 for(i=0;i<3;i++) {
                   if(block[i].status) {
-                    if(getAxis() != "x")
-                      block[i].revolve_block("left");
+                    if(getAxis() != AXIS_X)
+                      block[i].revolve_block(MOVE_LEFT);
                     else
-                      block[i].revolve_block("up");
+                      block[i].revolve_block(MOVE_UP);
                   }
                 }
                 break;
             case GLFW_KEY_RIGHT:
                 for(i=0;i<3;i++) {
                   if(block[i].status) {
-                    if(getAxis() != "x")  
-                      block[i].revolve_block("right");
+                    if(getAxis() != AXIS_X)  
+                      block[i].revolve_block(MOVE_RIGHT);
                     else
-                      block[i].revolve_block("down");
+                      block[i].revolve_block(MOVE_DOWN);
                   }
                 }
                 break;
             case GLFW_KEY_UP:
                 for(i=0;i<3;i++) {
-                  if(block[i].status)
-                    if(getAxis() != "x")
-                      block[i].revolve_block("up");
+                  if(block[i].status) {
+                    if(getAxis() != AXIS_X)
+                      block[i].revolve_block(MOVE_UP);
                     else
-                      block[i].revolve_block("right");
+                      block[i].revolve_block(MOVE_RIGHT);
+                  }
                 }
                 break;
             case GLFW_KEY_DOWN:
                 for(i=0;i<3;i++) {
-                  if(block[i].status)
-                    if(getAxis() != "x")
-                      block[i].revolve_block("down");
+                  if(block[i].status) {
+                    if(getAxis() != AXIS_X)
+                      block[i].revolve_block(MOVE_DOWN);
                     else
-                      block[i].revolve_block("left");
+                      block[i].revolve_block(MOVE_LEFT);
+                  }
                 }
                 break;
             case GLFW_KEY_T:
-                tower_view=1;
-                level_view=0;
-                top_view=0;
-                block_view=0;
-                front_view=0;
+                camera.setMode(TOWER_VIEW);
                 break;
             case GLFW_KEY_L:
-                level_view=1;
-                tower_view=0;
-                top_view=0;
-                block_view=0;
-                front_view=0;
+                camera.setMode(LEVEL_VIEW);
                 break;
             case GLFW_KEY_U:
-                top_view=1;
+                camera.setMode(TOP_VIEW);
                 target_mouse_x=0.4*5;
                 target_mouse_y=0.4*5;
-                tower_view=0;
-                level_view=0;
-                block_view=0;
-                front_view=0;
                 break;
             case GLFW_KEY_B:
-                block_view=1;
-                top_view=0;
-                tower_view=0;
-                level_view=0;
-                front_view=0;
+                camera.setMode(BLOCK_VIEW);
                 break;
             case GLFW_KEY_F:
-                block_view=0;
-                top_view=0;
-                tower_view=0;
-                level_view=0;
-                front_view=1;
+                camera.setMode(FRONT_VIEW);
                 break;
             case GLFW_KEY_C:
                 changeAxis();
                 break;
+            case GLFW_KEY_O:
+                sort_front_to_back = !sort_front_to_back;
+                break;
+            case GLFW_KEY_R:
+                overdraw.enabled = !overdraw.enabled;
+                break;
+            case GLFW_KEY_V:
+                record_board_draws = !record_board_draws;
+                break;
+            case GLFW_KEY_M:
+                memory_ledger.report();
+                break;
             default:
                 break;
         }
+        usePlayer(0);
+    }
+}
+
+#define LAST_LEVEL 2
+#define CHUNK_PREFETCH_PER_FRAME 1
+
+/* Each create_level_N lays its tiles out on the board it is given, the
+   current one or the upcoming one being prefetched */
+class Level {
+  public:
+    int stop_switch_x;
+    int stop_switch_y;
+
+    void build(int level, Board& board) {
+      switch (level) {
+        case 1:
+          create_level_1(board);
+          break;
+        case 2:
+          create_level_2(board);
+          break;
+      }
+    }
+
+    /* Switch state of the level being played */
+    void start() {
+      this->stop_switch_x=-1;
+      this->stop_switch_y=-1;
+    }
+
+    void create_level_1(Board& tiles) {
+      int i, j;
+
+      tiles.resize(10, 10);
+      tiles[8][8].create(0, 1, 1);
+      for(i=0;i<10;i++) {
+        for(j=0;j<10;j++) {
+          if(j!=8||i!=8) {
+            tiles[i][j].create(0, 0, 0);
+          }
+          tiles[i][j].x=tiles[i][j].width*i;
+          tiles[i][j].y=tiles[i][j].length*j;
+        }
+      }
+
+
+      for(i=0;i<7;i++) {
+        for(j=3;j<10;j++) {
+          tiles[i][j].status=0;
+        }
+      }
+      for(i=3;i<7;i++) {
+        tiles[i][2].status=0;
+        tiles[i][0].status=0;
+      }
+      for(i=3;i<7;i++) {
+        tiles[9][i].status=0;
+        tiles[7][i].status=0;
+      }
+    }
+
+    void create_level_2(Board& tiles) {
+      int i, j;
+
+      tiles.resize(10, 10);
+      for(i=0;i<10;i++) {
+        for(j=0;j<10;j++) {
+          tiles[i][j].create(0, 0, 0);
+        }
+      }
+
+      tiles[9][9].create(0, 1, 1);
+      tiles[9][0].create(1, 0, 0);
+      tiles[4][7].create(1, 0, 0);
+      tiles[2][2].create(0, 1, 0);
+      tiles[2][3].create(0, 1, 0);
+      tiles[3][2].create(0, 1, 0);
+      tiles[2][2].create(0, 1, 0);
+      tiles[2][3].create(0, 1, 0);
+      tiles[3][3].create(0, 1, 0);
+      tiles[1][2].create(0, 1, 0);
+
+      for(i=4;i<9;i++)
+        tiles[0][i].create(0, 0, 1);
+
+      for(i=2;i<7;i++)
+        tiles[4][i].create(0, 0, 1);
+
+      for(i=0;i<10;i++) {
+        for(j=0;j<10;j++) {
+          tiles[i][j].status=0;
+        }
+      }
+
+      for(i=0;i<4;i++) {
+        for(j=0;j<4;j++) {
+          tiles[i][j].status=1;
+        }
+      }
+
+      for(i=4;i<9;i++)
+        tiles[i][0].status=1;
+      for(i=0;i<9;i++)
+        tiles[i][9].status=1;
+      tiles[9][9].status=1;
+      tiles[9][0].status=1;
+      tiles[4][7].status=1;
+
+      for(i=0;i<10;i++) {
+        for(j=0;j<10;j++) {
+          tiles[i][j].x=tiles[i][j].width*i;
+          tiles[i][j].y=tiles[i][j].length*j;
+        }
+      }
+    }
+
+    void switch_level_2() {
+      int i;
+      if(this->stop_switch_x!=currIndexX||this->stop_switch_y!=currIndexY) {
+        this->stop_switch_x=currX;
+        this->stop_switch_y=currY;
+        if(isOnTile(9, 0)) {
+          if(tiles[9][0].toggle_swtich) {
+            for(i=2;i<7;i++) {
+              tiles.setStatus(4, i, 0);
+            }
+            tiles[9][0].toggle_swtich=0;
+          }
+          else {
+            for(i=2;i<7;i++) {
+              tiles.setStatus(4, i, 1);
+            } 
+            tiles[9][0].toggle_swtich=0;
+          }
+        }
+        else if(isOnTile(4, 7)) {
+          if(tiles[4][7].toggle_swtich) {
+            for(i=4;i<9;i++) {
+              tiles.setStatus(0, i, 0);
+            }
+            tiles[4][7].toggle_swtich=0;
+          }
+          else {
+            for(i=4;i<9;i++) {
+              tiles.setStatus(0, i, 1);
+            }
+            tiles[4][7].toggle_swtich=0;
+          }
+        }
+      }
+    }
+};
+
+Level levels;
+
+/* Starts the death (or level finish) fall, vertical drops do not spin */
+void startFall(bool vertical) {
+  if(!DYING) {
+    fall_start=getGameTime();
+    block_anim_dirty=1;
+    // Dust kicked up where the block goes over the edge
+    for(int i=0;i<3;i++) {
+      if(block[i].status)
+        particles.burst(glm::vec3(block[i].x, block[i].y, 0.1), glm::vec3(block[i].width, block[i].length, 0.1), glm::vec3(0.6, 0.6, 0.7), 1.2, 4000);
+    }
+  }
+  DYING=1;
+  if(vertical && !vert_fall) {
+    vert_fall=1;
+    block_anim_dirty=1;
+  }
+}
+
+void updateClock () {
+  total_time++;
+  score_board[2].create(3+0.3, 0, total_time%10);
+  score_board[3].create(3, 0, total_time/10);
+}
+
+void updateGameStatus() {
+
+  updateScore (-3, 0);
+
+  int i, j;
+  // Only the tiles around the block can be under it
+  int x=lround(currX/0.4), y=lround(currY/0.4);
+  for(i=x-1;i<=x+1;i++) {
+    for(j=y-1;j<=y+1;j++) {
+      if(tiles.inside(i, j) && tiles[i][j].status) {
+        if(tiles[i][j].is_finish) {
+          if(isOnTile(i, j)) {
+            if(!DYING) {
+              // Only the first finisher moves the race on, a second one
+              // during the winner's fall must not skip a level
+              if(built_level == currLevel)
+                currLevel++;
+              startFall(1);
+            }
+          }
+        }
+        if(tiles[i][j].is_fragile) {
+          if(isOnTile(i, j)) {
+            // The tile breaks away under the standing block
+            tiles.setStatus(i, j, 0);
+            startFall(1);
+          }
+        }
+      }
+    }
+  }
+
+  switch (currLevel) {
+    case 2:
+      levels.switch_level_2();
+      break;
+    default:
+      break;
+  }
+}
+
+void changePos(float X, float Y, BlockName axis) {
+  int i;
+  for(i=0;i<3;i++) {
+    block[i].status=0;
+    if(block[i].name == axis) {
+      block[i].x=X;
+      block[i].y=Y;
+      block[i].status=1;
+    }
+  }
+  currX=X;
+  currY=Y;
+  block_anim_dirty=1;
+}
+
+/* Puts the active player's block back on the start tile */
+// Every level starts the blocks on tile (1, 1)
+const glm::vec3 level_start(0.4*1, 0.4*1, 0);
+
+void resetPlayer() {
+  block[0].create(BLOCK_Z);
+  block[1].create(BLOCK_Y);
+  block[2].create(BLOCK_X);
+  changePos(level_start.x, level_start.y, BLOCK_Z);
+  vert_fall=0;
+  DYING=0;
+  fall_start=0;
+  block_anim_dirty=1;
+  X_POS=0;
+  X_NEG=0;
+  Y_POS=0;
+  Y_NEG=0;
+}
+
+void createGame() {
+  if(change_level) {
+    const long long heap_before=heap_stats.allocations;
+    const double build_start=glfwGetTime();
+    for(int p=player_count-1;p>=0;p--) {
+      usePlayer(p);
+      resetPlayer();
+    }
+    target_mouse_x=0.4*5;
+    target_mouse_y=0.4*5;
+    game_epoch=gameClock();
+    mouse_hit=0;
+    built_level=currLevel;
+    if(currLevel > LAST_LEVEL)
+      exit(1);
+    // A finished level hands over to the prefetched board, the previous
+    // board becomes the one the next level is prefetched into
+    bool prefetched = upcoming_level == currLevel;
+    if(prefetched) {
+      swap(tiles, upcoming);
+      upcoming_level=0;
+    }
+    else
+      levels.build(currLevel, tiles);
+    levels.start();
+    int stale=tiles.refresh();
+    if(currLevel < LAST_LEVEL && upcoming_level != currLevel+1) {
+      levels.build(currLevel+1, upcoming);
+      upcoming.refresh();
+      upcoming.trim(level_start);
+      upcoming_level=currLevel+1;
+    }
+    // Nothing follows the last level, the board it was swapped out of
+    // would otherwise keep its meshes for the rest of the session
+    else if(currLevel >= LAST_LEVEL)
+      upcoming.unload();
+    change_level=0;
+    if(sim_clock < 0)
+      printf("level %d: %s in %.0f us, %d of %d chunks to rebake, %zu bytes from the level arena, %lld heap allocations\n",
+           currLevel, prefetched ? "swapped in" : "built", (glfwGetTime()-build_start)*1e6, stale, tiles.chunk_count,
+           tiles.arena->used, heap_stats.allocations-heap_before);
+  }
+}
+
+void checkGameStatus(GLFWwindow* window) {
+  int i, j;
+
+  if(DYING&&getGameTime()-fall_start>FALL_DURATION) {
+    // In a race only the winner's finish restarts the board, a player
+    // that fell off starts over on their own
+    if(player_count > 1 && built_level == currLevel)
+      resetPlayer();
+    else
+      change_level=1;
+  }
+
+  if(currX>(tiles.width-1)*0.4+0.3||currX<0||currY>(tiles.height-1)*0.4+0.3||currY<0) {
+    startFall(0);
+  }
+
+  int x=lround(currX/0.4), y=lround(currY/0.4);
+  for(i=x-1;i<=x+1;i++) {
+    for(j=y-1;j<=y+1;j++) {
+      if(tiles.inside(i, j) && !tiles[i][j].status) {
+        if(abs(currX-tiles[i][j].x)<0.3&&abs(currY-tiles[i][j].y)<0.3) {
+          startFall(0);
+        }
+      }
+    }
+  }
+}
+
+/* Records every GL call the game makes, with its data, into a GLCapture.h
+   file for the replayer. The glad function pointers are swapped for
+   wrappers that write the call and then forward it to the driver. */
+class GLCapture {
+  public:
+    FILE* file;
+    int frames_left;
+
+    void op(uint16_t op) {
+      fwrite(&op, sizeof(op), 1, this->file);
+    }
+
+    void u32(uint32_t value) {
+      fwrite(&value, sizeof(value), 1, this->file);
+    }
+
+    void u64(uint64_t value) {
+      fwrite(&value, sizeof(value), 1, this->file);
+    }
+
+    void f32(float value) {
+      fwrite(&value, sizeof(value), 1, this->file);
+    }
+
+    void payload(const void* data, uint32_t size) {
+      u32(size);
+      if(size)
+        fwrite(data, 1, size, this->file);
+    }
+
+    void names(GLsizei n, const GLuint* names) {
+      u32(n);
+      fwrite(names, sizeof(GLuint), n, this->file);
+    }
+};
+
+GLCapture capture;
+
+PFNGLCREATESHADERPROC real_glCreateShader;
+PFNGLSHADERSOURCEPROC real_glShaderSource;
+PFNGLCOMPILESHADERPROC real_glCompileShader;
+PFNGLDELETESHADERPROC real_glDeleteShader;
+PFNGLCREATEPROGRAMPROC real_glCreateProgram;
+PFNGLATTACHSHADERPROC real_glAttachShader;
+PFNGLTRANSFORMFEEDBACKVARYINGSPROC real_glTransformFeedbackVaryings;
+PFNGLLINKPROGRAMPROC real_glLinkProgram;
+PFNGLUSEPROGRAMPROC real_glUseProgram;
+PFNGLGETUNIFORMLOCATIONPROC real_glGetUniformLocation;
+PFNGLUNIFORM1FPROC real_glUniform1f;
+PFNGLUNIFORM3FPROC real_glUniform3f;
+PFNGLUNIFORM1IPROC real_glUniform1i;
+PFNGLUNIFORM1FVPROC real_glUniform1fv;
+PFNGLUNIFORM3FVPROC real_glUniform3fv;
+PFNGLUNIFORM1IVPROC real_glUniform1iv;
+PFNGLUNIFORMMATRIX4FVPROC real_glUniformMatrix4fv;
+PFNGLGENBUFFERSPROC real_glGenBuffers;
+PFNGLDELETEBUFFERSPROC real_glDeleteBuffers;
+PFNGLBINDBUFFERPROC real_glBindBuffer;
+PFNGLBINDBUFFERBASEPROC real_glBindBufferBase;
+PFNGLBUFFERDATAPROC real_glBufferData;
+PFNGLBUFFERSUBDATAPROC real_glBufferSubData;
+PFNGLGENVERTEXARRAYSPROC real_glGenVertexArrays;
+PFNGLDELETEVERTEXARRAYSPROC real_glDeleteVertexArrays;
+PFNGLBINDVERTEXARRAYPROC real_glBindVertexArray;
+PFNGLENABLEVERTEXATTRIBARRAYPROC real_glEnableVertexAttribArray;
+PFNGLDISABLEVERTEXATTRIBARRAYPROC real_glDisableVertexAttribArray;
+PFNGLVERTEXATTRIBPOINTERPROC real_glVertexAttribPointer;
+PFNGLENABLEPROC real_glEnable;
+PFNGLDISABLEPROC real_glDisable;
+PFNGLCLEARCOLORPROC real_glClearColor;
+PFNGLCLEARDEPTHPROC real_glClearDepth;
+PFNGLCLEARPROC real_glClear;
+PFNGLVIEWPORTPROC real_glViewport;
+PFNGLPOLYGONMODEPROC real_glPolygonMode;
+PFNGLDEPTHFUNCPROC real_glDepthFunc;
+PFNGLDRAWARRAYSPROC real_glDrawArrays;
+PFNGLDRAWARRAYSINSTANCEDPROC real_glDrawArraysInstanced;
+PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXPROC real_glDrawElementsInstancedBaseVertex;
+PFNGLBEGINTRANSFORMFEEDBACKPROC real_glBeginTransformFeedback;
+PFNGLENDTRANSFORMFEEDBACKPROC real_glEndTransformFeedback;
+PFNGLFENCESYNCPROC real_glFenceSync;
+PFNGLCLIENTWAITSYNCPROC real_glClientWaitSync;
+PFNGLDELETESYNCPROC real_glDeleteSync;
+PFNGLGENQUERIESPROC real_glGenQueries;
+PFNGLBEGINQUERYPROC real_glBeginQuery;
+PFNGLENDQUERYPROC real_glEndQuery;
+
+GLuint APIENTRY capture_glCreateShader(GLenum type) {
+  GLuint shader = real_glCreateShader(type);
+  capture.op(CAP_CREATE_SHADER); capture.u32(type); capture.u32(shader);
+  return shader;
+}
+
+void APIENTRY capture_glShaderSource(GLuint shader, GLsizei count, const GLchar* const* string, const GLint* length) {
+  std::string source;
+  for(int i=0;i<count;i++)
+    source.append(string[i], length ? length[i] : strlen(string[i]));
+  capture.op(CAP_SHADER_SOURCE); capture.u32(shader); capture.payload(source.data(), source.size());
+  real_glShaderSource(shader, count, string, length);
+}
+
+void APIENTRY capture_glCompileShader(GLuint shader) {
+  capture.op(CAP_COMPILE_SHADER); capture.u32(shader);
+  real_glCompileShader(shader);
+}
+
+void APIENTRY capture_glDeleteShader(GLuint shader) {
+  capture.op(CAP_DELETE_SHADER); capture.u32(shader);
+  real_glDeleteShader(shader);
+}
+
+GLuint APIENTRY capture_glCreateProgram() {
+  GLuint program = real_glCreateProgram();
+  capture.op(CAP_CREATE_PROGRAM); capture.u32(program);
+  return program;
+}
+
+void APIENTRY capture_glAttachShader(GLuint program, GLuint shader) {
+  capture.op(CAP_ATTACH_SHADER); capture.u32(program); capture.u32(shader);
+  real_glAttachShader(program, shader);
+}
+
+void APIENTRY capture_glTransformFeedbackVaryings(GLuint program, GLsizei count, const GLchar* const* varyings, GLenum bufferMode) {
+  capture.op(CAP_TRANSFORM_FEEDBACK_VARYINGS); capture.u32(program); capture.u32(count); capture.u32(bufferMode);
+  for(int i=0;i<count;i++)
+    capture.payload(varyings[i], strlen(varyings[i]));
+  real_glTransformFeedbackVaryings(program, count, varyings, bufferMode);
+}
+
+void APIENTRY capture_glLinkProgram(GLuint program) {
+  capture.op(CAP_LINK_PROGRAM); capture.u32(program);
+  real_glLinkProgram(program);
+}
+
+void APIENTRY capture_glUseProgram(GLuint program) {
+  capture.op(CAP_USE_PROGRAM); capture.u32(program);
+  real_glUseProgram(program);
+}
+
+GLint APIENTRY capture_glGetUniformLocation(GLuint program, const GLchar* name) {
+  GLint location = real_glGetUniformLocation(program, name);
+  capture.op(CAP_GET_UNIFORM_LOCATION); capture.u32(program); capture.u32(location); capture.payload(name, strlen(name));
+  return location;
+}
+
+void APIENTRY capture_glUniform1f(GLint location, GLfloat x) {
+  capture.op(CAP_UNIFORM_1F); capture.u32(location); capture.f32(x);
+  real_glUniform1f(location, x);
+}
+
+void APIENTRY capture_glUniform3f(GLint location, GLfloat x, GLfloat y, GLfloat z) {
+  capture.op(CAP_UNIFORM_3F); capture.u32(location); capture.f32(x); capture.f32(y); capture.f32(z);
+  real_glUniform3f(location, x, y, z);
+}
+
+void APIENTRY capture_glUniform1i(GLint location, GLint x) {
+  capture.op(CAP_UNIFORM_1I); capture.u32(location); capture.u32(x);
+  real_glUniform1i(location, x);
+}
+
+void APIENTRY capture_glUniform1fv(GLint location, GLsizei count, const GLfloat* value) {
+  capture.op(CAP_UNIFORM_1FV); capture.u32(location); capture.u32(count); capture.payload(value, count*sizeof(GLfloat));
+  real_glUniform1fv(location, count, value);
+}
+
+void APIENTRY capture_glUniform3fv(GLint location, GLsizei count, const GLfloat* value) {
+  capture.op(CAP_UNIFORM_3FV); capture.u32(location); capture.u32(count); capture.payload(value, 3*count*sizeof(GLfloat));
+  real_glUniform3fv(location, count, value);
+}
+
+void APIENTRY capture_glUniform1iv(GLint location, GLsizei count, const GLint* value) {
+  capture.op(CAP_UNIFORM_1IV); capture.u32(location); capture.u32(count); capture.payload(value, count*sizeof(GLint));
+  real_glUniform1iv(location, count, value);
+}
+
+void APIENTRY capture_glUniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value) {
+  capture.op(CAP_UNIFORM_MATRIX_4FV); capture.u32(location); capture.u32(count); capture.u32(transpose);
+  capture.payload(value, 16*count*sizeof(GLfloat));
+  real_glUniformMatrix4fv(location, count, transpose, value);
+}
+
+void APIENTRY capture_glGenBuffers(GLsizei n, GLuint* buffers) {
+  real_glGenBuffers(n, buffers);
+  capture.op(CAP_GEN_BUFFERS); capture.names(n, buffers);
+}
+
+void APIENTRY capture_glDeleteBuffers(GLsizei n, const GLuint* buffers) {
+  capture.op(CAP_DELETE_BUFFERS); capture.names(n, buffers);
+  real_glDeleteBuffers(n, buffers);
+}
+
+void APIENTRY capture_glBindBuffer(GLenum target, GLuint buffer) {
+  capture.op(CAP_BIND_BUFFER); capture.u32(target); capture.u32(buffer);
+  real_glBindBuffer(target, buffer);
+}
+
+void APIENTRY capture_glBindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+  capture.op(CAP_BIND_BUFFER_BASE); capture.u32(target); capture.u32(index); capture.u32(buffer);
+  real_glBindBufferBase(target, index, buffer);
+}
+
+void APIENTRY capture_glBufferData(GLenum target, GLsizeiptr size, const void* data, GLenum usage) {
+  capture.op(CAP_BUFFER_DATA); capture.u32(target); capture.u32(usage); capture.u32(size); capture.u32(data != NULL);
+  capture.payload(data, data ? size : 0);
+  real_glBufferData(target, size, data, usage);
+}
+
+void APIENTRY capture_glBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void* data) {
+  capture.op(CAP_BUFFER_SUB_DATA); capture.u32(target); capture.u64(offset);
+  capture.payload(data, size);
+  real_glBufferSubData(target, offset, size, data);
+}
+
+void APIENTRY capture_glGenVertexArrays(GLsizei n, GLuint* arrays) {
+  real_glGenVertexArrays(n, arrays);
+  capture.op(CAP_GEN_VERTEX_ARRAYS); capture.names(n, arrays);
+}
+
+void APIENTRY capture_glDeleteVertexArrays(GLsizei n, const GLuint* arrays) {
+  capture.op(CAP_DELETE_VERTEX_ARRAYS); capture.names(n, arrays);
+  real_glDeleteVertexArrays(n, arrays);
+}
+
+void APIENTRY capture_glBindVertexArray(GLuint array) {
+  capture.op(CAP_BIND_VERTEX_ARRAY); capture.u32(array);
+  real_glBindVertexArray(array);
+}
+
+void APIENTRY capture_glEnableVertexAttribArray(GLuint index) {
+  capture.op(CAP_ENABLE_VERTEX_ATTRIB_ARRAY); capture.u32(index);
+  real_glEnableVertexAttribArray(index);
+}
+
+void APIENTRY capture_glDisableVertexAttribArray(GLuint index) {
+  capture.op(CAP_DISABLE_VERTEX_ATTRIB_ARRAY); capture.u32(index);
+  real_glDisableVertexAttribArray(index);
+}
+
+void APIENTRY capture_glVertexAttribPointer(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer) {
+  capture.op(CAP_VERTEX_ATTRIB_POINTER); capture.u32(index); capture.u32(size); capture.u32(type); capture.u32(normalized);
+  capture.u32(stride); capture.u64((uintptr_t)pointer);
+  real_glVertexAttribPointer(index, size, type, normalized, stride, pointer);
+}
+
+void APIENTRY capture_glEnable(GLenum cap) {
+  capture.op(CAP_ENABLE); capture.u32(cap);
+  real_glEnable(cap);
+}
+
+void APIENTRY capture_glDisable(GLenum cap) {
+  capture.op(CAP_DISABLE); capture.u32(cap);
+  real_glDisable(cap);
+}
+
+void APIENTRY capture_glClearColor(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha) {
+  capture.op(CAP_CLEAR_COLOR); capture.f32(red); capture.f32(green); capture.f32(blue); capture.f32(alpha);
+  real_glClearColor(red, green, blue, alpha);
+}
+
+void APIENTRY capture_glClearDepth(GLdouble depth) {
+  capture.op(CAP_CLEAR_DEPTH); capture.f32(depth);
+  real_glClearDepth(depth);
+}
+
+void APIENTRY capture_glClear(GLbitfield mask) {
+  capture.op(CAP_CLEAR); capture.u32(mask);
+  real_glClear(mask);
+}
+
+void APIENTRY capture_glViewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+  capture.op(CAP_VIEWPORT); capture.u32(x); capture.u32(y); capture.u32(width); capture.u32(height);
+  real_glViewport(x, y, width, height);
+}
+
+void APIENTRY capture_glPolygonMode(GLenum face, GLenum mode) {
+  capture.op(CAP_POLYGON_MODE); capture.u32(face); capture.u32(mode);
+  real_glPolygonMode(face, mode);
+}
+
+void APIENTRY capture_glDepthFunc(GLenum func) {
+  capture.op(CAP_DEPTH_FUNC); capture.u32(func);
+  real_glDepthFunc(func);
+}
+
+void APIENTRY capture_glDrawArrays(GLenum mode, GLint first, GLsizei count) {
+  capture.op(CAP_DRAW_ARRAYS); capture.u32(mode); capture.u32(first); capture.u32(count);
+  real_glDrawArrays(mode, first, count);
+}
+
+void APIENTRY capture_glDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instances) {
+  capture.op(CAP_DRAW_ARRAYS_INSTANCED); capture.u32(mode); capture.u32(first); capture.u32(count); capture.u32(instances);
+  real_glDrawArraysInstanced(mode, first, count, instances);
+}
+
+void APIENTRY capture_glDrawElementsInstancedBaseVertex(GLenum mode, GLsizei count, GLenum type, const void* indices, GLsizei instances, GLint basevertex) {
+  capture.op(CAP_DRAW_ELEMENTS_INSTANCED_BASE_VERTEX); capture.u32(mode); capture.u32(count); capture.u32(type);
+  capture.u64((uintptr_t)indices); capture.u32(instances); capture.u32(basevertex);
+  real_glDrawElementsInstancedBaseVertex(mode, count, type, indices, instances, basevertex);
+}
+
+void APIENTRY capture_glBeginTransformFeedback(GLenum mode) {
+  capture.op(CAP_BEGIN_TRANSFORM_FEEDBACK); capture.u32(mode);
+  real_glBeginTransformFeedback(mode);
+}
+
+void APIENTRY capture_glEndTransformFeedback() {
+  capture.op(CAP_END_TRANSFORM_FEEDBACK);
+  real_glEndTransformFeedback();
+}
+
+GLsync APIENTRY capture_glFenceSync(GLenum condition, GLbitfield flags) {
+  GLsync sync = real_glFenceSync(condition, flags);
+  capture.op(CAP_FENCE_SYNC); capture.u64((uintptr_t)sync);
+  return sync;
+}
+
+GLenum APIENTRY capture_glClientWaitSync(GLsync sync, GLbitfield flags, GLuint64 timeout) {
+  capture.op(CAP_CLIENT_WAIT_SYNC); capture.u64((uintptr_t)sync); capture.u32(flags); capture.u64(timeout);
+  return real_glClientWaitSync(sync, flags, timeout);
+}
+
+void APIENTRY capture_glDeleteSync(GLsync sync) {
+  capture.op(CAP_DELETE_SYNC); capture.u64((uintptr_t)sync);
+  real_glDeleteSync(sync);
+}
+
+void APIENTRY capture_glGenQueries(GLsizei n, GLuint* ids) {
+  real_glGenQueries(n, ids);
+  capture.op(CAP_GEN_QUERIES); capture.names(n, ids);
+}
+
+void APIENTRY capture_glBeginQuery(GLenum target, GLuint id) {
+  capture.op(CAP_BEGIN_QUERY); capture.u32(target); capture.u32(id);
+  real_glBeginQuery(target, id);
+}
+
+void APIENTRY capture_glEndQuery(GLenum target) {
+  capture.op(CAP_END_QUERY); capture.u32(target);
+  real_glEndQuery(target);
+}
+
+// Every hooked entry point, the argument is pasted so glad's macros do not expand it
+#define CAPTURED_GL_CALLS(X) \
+  X(glCreateShader)\
+  X(glShaderSource)\
+  X(glCompileShader)\
+  X(glDeleteShader)\
+  X(glCreateProgram)\
+  X(glAttachShader)\
+  X(glTransformFeedbackVaryings)\
+  X(glLinkProgram)\
+  X(glUseProgram)\
+  X(glGetUniformLocation)\
+  X(glUniform1f)\
+  X(glUniform3f)\
+  X(glUniform1i)\
+  X(glUniform1fv)\
+  X(glUniform3fv)\
+  X(glUniform1iv)\
+  X(glUniformMatrix4fv)\
+  X(glGenBuffers)\
+  X(glDeleteBuffers)\
+  X(glBindBuffer)\
+  X(glBindBufferBase)\
+  X(glBufferData)\
+  X(glBufferSubData)\
+  X(glGenVertexArrays)\
+  X(glDeleteVertexArrays)\
+  X(glBindVertexArray)\
+  X(glEnableVertexAttribArray)\
+  X(glDisableVertexAttribArray)\
+  X(glVertexAttribPointer)\
+  X(glEnable)\
+  X(glDisable)\
+  X(glClearColor)\
+  X(glClearDepth)\
+  X(glClear)\
+  X(glViewport)\
+  X(glPolygonMode)\
+  X(glDepthFunc)\
+  X(glDrawArrays)\
+  X(glDrawArraysInstanced)\
+  X(glDrawElementsInstancedBaseVertex)\
+  X(glBeginTransformFeedback)\
+  X(glEndTransformFeedback)\
+  X(glFenceSync)\
+  X(glClientWaitSync)\
+  X(glDeleteSync)\
+  X(glGenQueries)\
+  X(glBeginQuery)\
+  X(glEndQuery)
+
+#define CAPTURE_HOOK(name) real_##name = glad_##name; glad_##name = capture_##name;
+
+/* Starts recording into path, call right after the context is created */
+void startCapture(const char* path, int frames, int width, int height) {
+  capture.file = fopen(path, "wb");
+  if(!capture.file) {
+    fprintf(stderr, "Cannot open %s for the capture\n", path);
+    return;
+  }
+  GLCaptureHeader header = {GLCAPTURE_MAGIC, GLCAPTURE_VERSION, (uint32_t)width, (uint32_t)height};
+  fwrite(&header, sizeof(header), 1, capture.file);
+  capture.frames_left = frames;
+
+  CAPTURED_GL_CALLS(CAPTURE_HOOK)
+}
+
+#undef CAPTURE_HOOK
+
+#define CAPTURE_UNHOOK(name) glad_##name = real_##name;
+
+/* Marks the end of a frame, the capture closes after the requested count */
+void captureFrame() {
+  if(!capture.file)
+    return;
+  capture.op(CAP_FRAME);
+  if(--capture.frames_left > 0)
+    return;
+
+  CAPTURED_GL_CALLS(CAPTURE_UNHOOK)
+
+  fclose(capture.file);
+  capture.file=NULL;
+  printf("Capture finished\n");
+}
+
+#undef CAPTURE_UNHOOK
+
+/* Caps how many frames the driver may queue ahead of the GPU. A fence is
+   dropped after every swap and the next frame only starts once the one
+   max_in_flight frames back has finished, so input is sampled at most
+   that many frames before it reaches the screen. */
+class FrameLimiter {
+  public:
+    int max_in_flight;
+    int index;
+    vector<GLsync> fences;
+
+    void create(int max_in_flight) {
+      this->max_in_flight=max(1, max_in_flight);
+      this->index=0;
+      this->fences.assign(this->max_in_flight, (GLsync)0);
+    }
+
+    void wait() {
+      GLsync& fence = this->fences[this->index];
+      if(fence) {
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        glDeleteSync(fence);
+        fence=0;
+      }
     }
+
+    void insert() {
+      this->fences[this->index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      this->index = (this->index+1)%this->max_in_flight;
+    }
+};
+
+FrameLimiter frame_limiter;
+
+/* Moves every player's block and builds the next level when one is due */
+void stepGame(GLFWwindow* window) {
+  for(int p=0;p<player_count;p++) {
+    usePlayer(p);
+    checkGameStatus(window);
+    updateGameStatus();
+    getCurrIndex();
+  }
+  usePlayer(0);
+  createGame();
 }
 
-class Level {
+#define ALLOCATION_WARMUP_FRAMES 60
+
+/* With --check-allocations, aborts when a frame of a running level
+   reaches the general heap. The frame that builds a level and the ones
+   right after it are exempt, as is any frame that bakes chunks of either
+   board, since a bake may need a new VAO record. */
+class FrameAllocationCheck {
   public:
-    int stop_switch_x;
-    int stop_switch_y;
+    bool enabled;
+    long long at_start;
+    double level_epoch;
+    int level_frames;
+
+    void begin() {
+      this->at_start = heap_stats.allocations;
+      chunk_bakes = 0;
+    }
 
-    void create_level_1() {
-      int i, j;
+    void end() {
+      if(game_epoch != this->level_epoch) {
+        this->level_epoch = game_epoch;
+        this->level_frames = 0;
+      }
+      long long count = heap_stats.allocations - this->at_start;
+      if(this->enabled && count && this->level_frames >= ALLOCATION_WARMUP_FRAMES && !chunk_bakes) {
+        fprintf(stderr, "%lld heap allocations in frame %d of the level\n", count, this->level_frames);
+        abort();
+      }
+      this->level_frames++;
+    }
+} frame_allocations;
+
+/* Draws, swaps and closes the frame */
+void renderFrame(GLFWwindow* window) {
+  // OpenGL Draw commands
+  draw(window, 1);
+  draw(window, 0);
+
+  // Bake the next level's chunks a few at a time
+  if(upcoming_level)
+    upcoming.prebake(CHUNK_PREFETCH_PER_FRAME, level_start);
+
+  // Swap Frame Buffer in double buffering
+  glfwSwapBuffers(window);
+  frame_limiter.insert();
+  captureFrame();
+  frame_arena.reset();
+}
 
-      tiles[8][8].create(0, 1, 1);
-      for(i=0;i<10;i++) {
-        for(j=0;j<10;j++) {
-          if(j!=8||i!=8) {
-            tiles[i][j].create(0, 0, 0);
-          }
-          tiles[i][j].x=tiles[i][j].width*i;
-          tiles[i][j].y=tiles[i][j].length*j;
-        }
+#define SOAK_STEP (1.0/60)
+#define SOAK_SAMPLE_SECONDS 60
+#define SOAK_MOVE_SECONDS 0.6
+#define SOAK_DEATH_SECONDS 45
+#define SOAK_FINISH_SECONDS 120
+
+struct SoakSample {
+  double rss;           // bytes
+  double gl_objects;    // live buffers and vertex arrays
+  double frame_ms;      // mean real time per frame since the last sample
+};
+
+/* Drives the game headless on a simulated clock with random moves,
+   scripted deaths and level completions, sampling resident memory, GL
+   object counts and frame time. Fails when the later half of the run
+   sits clearly above the earlier half, the signature of a leak. */
+class SoakTest {
+  public:
+    double hours;
+    vector<SoakSample> samples;
+
+    bool active() const {
+      return this->hours > 0;
+    }
+
+    static double residentBytes() {
+      long pages=0, resident=0;
+      FILE* statm = fopen("/proc/self/statm", "r");
+      if(statm) {
+        if(fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+          resident=0;
+        fclose(statm);
+        return (double)resident*sysconf(_SC_PAGESIZE);
       }
+      // No procfs, the peak still shows growth
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+      return usage.ru_maxrss;
+#else
+      return usage.ru_maxrss*1024.0;
+#endif
+    }
 
+    /* Mean of the samples in [first, last) */
+    static double mean(const vector<SoakSample>& samples, int first, int last, double SoakSample::*field) {
+      double sum=0;
+      for(int i=first;i<last;i++)
+        sum += samples[i].*field;
+      return sum/max(1, last-first);
+    }
 
-      for(i=0;i<7;i++) {
-        for(j=3;j<10;j++) {
-          tiles[i][j].status=0;
+    bool check(const char* name, double SoakSample::*field, double ratio, double slack) {
+      // The first tenth is warmup: pools, caches and the driver filling up
+      int first = this->samples.size()/10;
+      int middle = (first+this->samples.size())/2;
+      double early = mean(this->samples, first, middle, field);
+      double late = mean(this->samples, middle, this->samples.size(), field);
+      bool grew = late > early*ratio + slack;
+      printf("soak: %-10s %12.1f -> %12.1f %s\n", name, early, late, grew ? "GROWING" : "ok");
+      return !grew;
+    }
+
+    int run(GLFWwindow* window) {
+      const double end = this->hours*3600;
+      double next_move=0, next_death=SOAK_DEATH_SECONDS, next_finish=SOAK_FINISH_SECONDS;
+      double next_sample=SOAK_SAMPLE_SECONDS, next_tick=1;
+      double sample_start=glfwGetTime();
+      int frames=0, deaths=0, finishes=0;
+      const int arrows[4] = {GLFW_KEY_UP, GLFW_KEY_DOWN, GLFW_KEY_LEFT, GLFW_KEY_RIGHT};
+      const int wasd[4] = {GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D};
+
+      srand(1);
+      glfwSwapInterval(0);
+      for(sim_clock=0;sim_clock<end;sim_clock+=SOAK_STEP) {
+        frame_limiter.wait();
+        glfwPollEvents();
+
+        // Through the key handler, exactly as a player would
+        if(sim_clock >= next_move) {
+          keyboard(window, arrows[rand()%4], 0, GLFW_PRESS, 0);
+          if(player_count > 1)
+            keyboard(window, wasd[rand()%4], 0, GLFW_PRESS, 0);
+          next_move += SOAK_MOVE_SECONDS;
+        }
+        if(sim_clock >= next_death) {
+          startFall(0);
+          deaths++;
+          next_death += SOAK_DEATH_SECONDS;
+        }
+        // Same as stepping on the finish tile
+        if(sim_clock >= next_finish && !DYING) {
+          if(built_level == currLevel)
+            currLevel++;
+          startFall(1);
+          finishes++;
+          next_finish += SOAK_FINISH_SECONDS;
+        }
+        if(currLevel > LAST_LEVEL)
+          currLevel = 1;
+
+        frame_allocations.begin();
+        stepGame(window);
+        if(sim_clock >= next_tick) {
+          updateClock();
+          next_tick += 1;
+        }
+        renderFrame(window);
+        frame_allocations.end();
+        frames++;
+
+        if(sim_clock >= next_sample) {
+          SoakSample sample;
+          glFinish();
+          sample.rss = residentBytes();
+          sample.gl_objects = gl_objects.live_buffers + gl_objects.live_vertex_arrays;
+          sample.frame_ms = (glfwGetTime()-sample_start)*1000/frames;
+          this->samples.push_back(sample);
+          printf("soak: %6.0f s  rss %.1f MB  gl objects %.0f  frame %.3f ms  deaths %d  levels %d\n",
+                 sim_clock, sample.rss/(1<<20), sample.gl_objects, sample.frame_ms, deaths, finishes);
+          fflush(stdout);
+          sample_start=glfwGetTime();
+          frames=0;
+          next_sample += SOAK_SAMPLE_SECONDS;
         }
       }
-      for(i=3;i<7;i++) {
-        tiles[i][2].status=0;
-        tiles[i][0].status=0;
-      }
-      for(i=3;i<7;i++) {
-        tiles[9][i].status=0;
-        tiles[7][i].status=0;
+
+      if(this->samples.size() < 10) {
+        printf("soak: too short to judge, run at least %d simulated minutes\n", 10*SOAK_SAMPLE_SECONDS/60);
+        return 1;
       }
+      // A few pages and one extra chunk's objects are noise, not a trend
+      bool ok = check("rss", &SoakSample::rss, 1.05, 1<<20);
+      ok = check("gl objects", &SoakSample::gl_objects, 1.0, 8) && ok;
+      ok = check("frame ms", &SoakSample::frame_ms, 1.25, 0.05) && ok;
+      printf("soak: %s\n", ok ? "passed" : "FAILED");
+      return ok ? 0 : 1;
     }
+};
 
-    void create_level_2() {
-      int i, j;
+SoakTest soak;
 
-      for(i=0;i<10;i++) {
-        for(j=0;j<10;j++) {
-          tiles[i][j].create(0, 0, 0);
-        }
-      }
+#define STARTUP_PHASES 16
 
-      this->stop_switch_x=-1;
-      this->stop_switch_y=-1;
+/* Wall time of every startup phase, measured from the start of main.
+   Phases on the audio thread overlap the ones on the main thread, the
+   report shows both and the time to the first frame on screen. */
+class StartupProfile {
+  public:
+    struct Phase {
+      const char* name;
+      bool audio;
+      double start;
+      double end;
+    };
 
-      tiles[9][9].create(0, 1, 1);
-      tiles[9][0].create(1, 0, 0);
-      tiles[4][7].create(1, 0, 0);
-      tiles[2][2].create(0, 1, 0);
-      tiles[2][3].create(0, 1, 0);
-      tiles[3][2].create(0, 1, 0);
-      tiles[2][2].create(0, 1, 0);
-      tiles[2][3].create(0, 1, 0);
-      tiles[3][3].create(0, 1, 0);
-      tiles[1][2].create(0, 1, 0);
+    chrono::steady_clock::time_point origin;
+    Phase phases[STARTUP_PHASES];
+    atomic<int> count;
 
-      for(i=4;i<9;i++)
-        tiles[0][i].create(0, 0, 1);
+    StartupProfile() : origin(chrono::steady_clock::now()), count(0) {}
 
-      for(i=2;i<7;i++)
-        tiles[4][i].create(0, 0, 1);
+    double now() const {
+      return chrono::duration<double>(chrono::steady_clock::now() - this->origin).count();
+    }
 
-      for(i=0;i<10;i++) {
-        for(j=0;j<10;j++) {
-          tiles[i][j].status=0;
-        }
-      }
+    /* Safe from either thread, every phase gets its own slot */
+    int begin(const char* name, bool audio=0) {
+      int index = this->count.fetch_add(1);
+      if(index >= STARTUP_PHASES)
+        return -1;
+      this->phases[index].name=name;
+      this->phases[index].audio=audio;
+      this->phases[index].start=now();
+      this->phases[index].end=-1;
+      return index;
+    }
 
-      for(i=0;i<4;i++) {
-        for(j=0;j<4;j++) {
-          tiles[i][j].status=1;
-        }
+    void end(int index) {
+      if(index >= 0)
+        this->phases[index].end=now();
+    }
+
+    void report() {
+      int count = min((int)this->count, STARTUP_PHASES);
+      printf("startup            thread  start ms  took ms\n");
+      for(int i=0;i<count;i++) {
+        const Phase& phase = this->phases[i];
+        printf("%-18s %-6s %8.1f %8.1f\n", phase.name, phase.audio ? "audio" : "main",
+               phase.start*1000, (phase.end-phase.start)*1000);
       }
+      printf("first frame after %.1f ms\n", now()*1000);
+    }
+} startup;
 
-      for(i=4;i<9;i++)
-        tiles[i][0].status=1;
-      for(i=0;i<9;i++)
-        tiles[i][9].status=1;
-      tiles[9][9].status=1;
-      tiles[9][0].status=1;
-      tiles[4][7].status=1;
+#define PCM_RING_BYTES (1<<18)
+#define PCM_CHUNK_BYTES 4096
 
-      for(i=0;i<10;i++) {
-        for(j=0;j<10;j++) {
-          tiles[i][j].x=tiles[i][j].width*i;
-          tiles[i][j].y=tiles[i][j].length*j;
-        }
+/* Single producer, single consumer byte ring. The decoder only moves
+   head and the player only moves tail, each publishing with a release
+   store that the other side reads with an acquire load, so neither ever
+   waits on a lock. Capacity is a power of two. */
+class PCMRing {
+  public:
+    unsigned char data[PCM_RING_BYTES];
+    atomic<size_t> head;  // total bytes written
+    atomic<size_t> tail;  // total bytes read
+
+    PCMRing() : head(0), tail(0) {}
+
+    size_t available() const {
+      return this->head.load(memory_order_acquire) - this->tail.load(memory_order_relaxed);
+    }
+
+    size_t space() const {
+      return PCM_RING_BYTES - (this->head.load(memory_order_relaxed) - this->tail.load(memory_order_acquire));
+    }
+
+    /* Producer side, all or nothing */
+    bool write(const unsigned char* bytes, size_t size) {
+      if(space() < size)
+        return 0;
+      size_t at = this->head.load(memory_order_relaxed);
+      for(size_t i=0;i<size;i++)
+        this->data[(at+i)&(PCM_RING_BYTES-1)] = bytes[i];
+      this->head.store(at+size, memory_order_release);
+      return 1;
+    }
+
+    /* Consumer side, all or nothing */
+    bool read(unsigned char* bytes, size_t size) {
+      if(available() < size)
+        return 0;
+      size_t at = this->tail.load(memory_order_relaxed);
+      for(size_t i=0;i<size;i++)
+        bytes[i] = this->data[(at+i)&(PCM_RING_BYTES-1)];
+      this->tail.store(at+size, memory_order_release);
+      return 1;
+    }
+};
+
+#define PCM_CACHE_MAGIC 0x4d435042   // "BPCM"
+
+/* Header of the decoded music cache, followed by pcm_bytes of samples in
+   the device format. Valid only for the MP3 with this hash and size. */
+struct PCMCacheHeader {
+  uint32_t magic;
+  uint32_t mp3_hash;
+  uint64_t mp3_bytes;
+  int32_t rate;
+  int32_t channels;
+  int32_t encoding;
+  uint32_t reserved;
+  uint64_t pcm_bytes;
+};
+
+void stopMusic();
+
+/* Background music, looped. open() only touches libao and mpg123, so it
+   can run on its own thread while the main thread brings up GL. Once
+   started, a decoder thread fills a PCMRing ahead of time and the audio
+   thread drains it into the blocking ao_play, so a slow device or a
+   slow decode never reaches the render loop.
+
+   The first run writes the decoded samples to <mp3>.pcm while playing.
+   Later runs map that file and copy from it instead of decoding, as long
+   as its header matches the MP3's hash and size. */
+class MusicPlayer {
+  public:
+    mpg123_handle* mh;
+    ao_device* dev;
+    unsigned char* buffer;
+    size_t buffer_size;
+    int frame_bytes;
+    long rate;
+    int channels;
+    int encoding;
+    // The MP3 the cache is keyed by
+    uint32_t mp3_hash;
+    uint64_t mp3_bytes;
+    char cache_path[1024];
+    // Mapped cache when there is a valid one, samples start at pcm
+    void* mapping;
+    size_t mapping_bytes;
+    const unsigned char* pcm;
+    size_t pcm_bytes;
+    size_t pcm_at;
+    // Cache being written by the first full decode
+    FILE* cache_out;
+    uint64_t cache_written;
+    PCMRing ring;
+    thread decoder;
+    thread player;
+    atomic<bool> running;
+    atomic<bool> decoding;
+    atomic<int> underruns;
+    // Set by open() once there is a device to play on
+    bool opened;
+
+    /* Maps path read-only, NULL if it can't be opened or is empty */
+    static void* mapFile(const char* path, size_t& size) {
+      struct stat info;
+      void* mapping = NULL;
+      int fd = ::open(path, O_RDONLY);
+      if(fd < 0)
+        return NULL;
+      if(fstat(fd, &info) == 0 && info.st_size > 0) {
+        size = info.st_size;
+        mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapping == MAP_FAILED)
+          mapping = NULL;
       }
+      ::close(fd);
+      return mapping;
     }
 
-    void switch_level_2() {
-      int i,j;
-      if(this->stop_switch_x!=currIndexX||this->stop_switch_y!=currIndexY) {
-        this->stop_switch_x=currX;
-        this->stop_switch_y=currY;
-        if(isOnTile(9, 0)) {
-          if(tiles[9][0].toggle_swtich) {
-            for(i=2;i<7;i++) {
-              tiles[4][i].status=0;
-            }
-            tiles[9][0].toggle_swtich=0;
-          }
-          else {
-            for(i=2;i<7;i++) {
-              tiles[4][i].status=1;
-            } 
-            tiles[9][0].toggle_swtich=0;
-          }
-        }
-        else if(isOnTile(4, 7)) {
-          if(tiles[4][7].toggle_swtich) {
-            for(i=4;i<9;i++) {
-              tiles[0][i].status=0;
-            }
-            tiles[4][7].toggle_swtich=0;
-          }
-          else {
-            for(i=4;i<9;i++) {
-              tiles[0][i].status=1;
-            }
-            tiles[4][7].toggle_swtich=0;
-          }
-        }
+    void hashMP3(const char* path) {
+      size_t size = 0;
+      void* mp3 = mapFile(path, size);
+      this->mp3_hash = mp3 ? hashBytes(mp3, size) : 0;
+      this->mp3_bytes = size;
+      if(mp3)
+        munmap(mp3, size);
+    }
+
+    bool mapCache() {
+      this->mapping = mapFile(this->cache_path, this->mapping_bytes);
+      if(!this->mapping)
+        return 0;
+      const PCMCacheHeader* header = (const PCMCacheHeader*)this->mapping;
+      if(this->mapping_bytes < sizeof(PCMCacheHeader) || header->magic != PCM_CACHE_MAGIC ||
+         header->mp3_hash != this->mp3_hash || header->mp3_bytes != this->mp3_bytes ||
+         !header->pcm_bytes || header->pcm_bytes != this->mapping_bytes - sizeof(PCMCacheHeader)) {
+        munmap(this->mapping, this->mapping_bytes);
+        this->mapping = NULL;
+        return 0;
       }
+      this->rate = header->rate;
+      this->channels = header->channels;
+      this->encoding = header->encoding;
+      this->pcm = (const unsigned char*)this->mapping + sizeof(PCMCacheHeader);
+      this->pcm_bytes = header->pcm_bytes;
+      this->pcm_at = 0;
+      return 1;
     }
-};
 
-Level levels;
+    /* The header goes in last, a cache cut short is never valid */
+    void finishCache() {
+      PCMCacheHeader header = {PCM_CACHE_MAGIC, this->mp3_hash, this->mp3_bytes, (int32_t)this->rate,
+                               this->channels, this->encoding, 0, this->cache_written};
+      char temporary[1040];
+      snprintf(temporary, sizeof(temporary), "%s.tmp", this->cache_path);
+      fseek(this->cache_out, 0, SEEK_SET);
+      fwrite(&header, sizeof(header), 1, this->cache_out);
+      bool ok = !ferror(this->cache_out);
+      fclose(this->cache_out);
+      this->cache_out = NULL;
+      if(ok && rename(temporary, this->cache_path) == 0)
+        printf("audio: decoded music cached in %s\n", this->cache_path);
+      else
+        remove(temporary);
+    }
 
-void updateClock () {
-  total_time++;
-  score_board[2].create(3+0.3, 0, total_time%10);
-  score_board[3].create(3, 0, total_time/10);
-}
+    void abandonCache() {
+      char temporary[1040];
+      snprintf(temporary, sizeof(temporary), "%s.tmp", this->cache_path);
+      fclose(this->cache_out);
+      this->cache_out = NULL;
+      remove(temporary);
+    }
 
-void updateGameStatus() {
+    /* Returns 0 when there is nothing to play on, the game then runs silent */
+    bool open(const char* path) {
+      ao_sample_format format;
+      int err;
+
+      int phase = startup.begin("audio init", 1);
+      ao_initialize();
+      int driver = ao_default_driver_id();
+      this->buffer_size = 2800;
+      this->buffer = (unsigned char*) malloc(this->buffer_size * sizeof(unsigned char));
+      startup.end(phase);
+
+      phase = startup.begin("pcm cache", 1);
+      snprintf(this->cache_path, sizeof(this->cache_path), "%s.pcm", path);
+      hashMP3(path);
+      bool cached = mapCache();
+      startup.end(phase);
+
+      if(!cached) {
+        /* open the file and get the decoding format */
+        phase = startup.begin("mp3 probe", 1);
+        mpg123_init();
+        this->mh = mpg123_new(NULL, &err);
+        bool probed = this->mh && mpg123_open(this->mh, path) == MPG123_OK &&
+          mpg123_getformat(this->mh, &this->rate, &this->channels, &this->encoding) == MPG123_OK &&
+          this->rate > 0 && this->channels > 0;
+        startup.end(phase);
+        if(!probed) {
+          fprintf(stderr, "audio: can't decode %s, music disabled\n", path);
+          return 0;
+        }
 
-  updateScore (-3, 0);
+        // Room for the header, written once the whole file is decoded
+        char temporary[1040];
+        snprintf(temporary, sizeof(temporary), "%s.tmp", this->cache_path);
+        this->cache_out = fopen(temporary, "wb");
+        this->cache_written = 0;
+        if(this->cache_out && fseek(this->cache_out, sizeof(PCMCacheHeader), SEEK_SET) != 0)
+          abandonCache();
+      }
+      this->frame_bytes = mpg123_encsize(this->encoding) * this->channels;
+
+      /* set the output format and open the output device */
+      phase = startup.begin("audio device", 1);
+      format.bits = mpg123_encsize(this->encoding) * BITS;
+      format.rate = this->rate;
+      format.channels = this->channels;
+      format.byte_format = AO_FMT_NATIVE;
+      format.matrix = 0;
+      this->dev = ao_open_live(driver, &format, NULL);
+      startup.end(phase);
+      if(!this->dev)
+        fprintf(stderr, "audio: no output device, music disabled\n");
+      this->opened = this->dev != NULL;
+      return this->opened;
+    }
 
-  int i, j;
-  for(i=0;i<10;i++) {
-    for(j=0;j<10;j++) {
-      if(tiles[i][j].status) {
-        if(tiles[i][j].is_finish) {
-          if(isOnTile(i, j)) {
-            if(!DYING) {
-              currLevel++;
-              vert_fall=1;
-              DYING=1;
-            }
-          }
+    void start() {
+      if(!this->opened)
+        return;
+      this->running = 1;
+      this->decoding = 1;
+      this->underruns = 0;
+      this->decoder = thread([this] { decode(); });
+      this->player = thread([this] { play(); });
+      // Threads must be joined before exit() tears down the globals
+      atexit(stopMusic);
+    }
+
+    /* decode ahead, or copy from the cache, waiting while the ring is full.
+       Stops on a decoder error or a song with no samples, play() then
+       drains what is left and stops too. */
+    void decode() {
+      size_t done;
+      int status;
+      bool looped_empty = 1;
+      while(this->running) {
+        if(this->ring.space() < this->buffer_size) {
+          this_thread::sleep_for(chrono::milliseconds(2));
+          continue;
         }
-        if(tiles[i][j].is_fragile) {
-          if(isOnTile(i, j)) {
-            vert_fall=1;
-            DYING=1;
+        if(this->pcm) {
+          done = min(this->buffer_size, this->pcm_bytes - this->pcm_at);
+          this->ring.write(this->pcm + this->pcm_at, done);
+          this->pcm_at = (this->pcm_at + done) % this->pcm_bytes;
+          continue;
+        }
+        status = mpg123_read(this->mh, this->buffer, this->buffer_size, &done);
+        if (status == MPG123_OK) {
+          looped_empty = 0;
+          this->ring.write(this->buffer, done);
+          if(this->cache_out) {
+            if(fwrite(this->buffer, 1, done, this->cache_out) == done)
+              this->cache_written += done;
+            else
+              abandonCache();
           }
         }
+        else if (status == MPG123_DONE && !looped_empty) {
+          // A clean first pass is the whole song
+          if(this->cache_out && this->cache_written)
+            finishCache();
+          else if(this->cache_out)
+            abandonCache();
+          looped_empty = 1;
+          mpg123_seek(this->mh, 0, SEEK_SET); // loop audio from start again if ended
+        }
+        else {
+          fprintf(stderr, "audio: decoding stopped: %s\n",
+                  status == MPG123_DONE ? "no samples" : mpg123_strerror(this->mh));
+          if(this->cache_out)
+            abandonCache();
+          break;
+        }
       }
+      this->decoding = 0;
     }
-  }
 
-  switch (currLevel) {
-    case 2:
-      levels.switch_level_2();
-      break;
-    default:
-      break;
-  }
-}
+    /* play whatever is decoded, silence and an underrun when nothing is */
+    void play() {
+      unsigned char chunk[PCM_CHUNK_BYTES];
+      const size_t size = PCM_CHUNK_BYTES - PCM_CHUNK_BYTES % max(1, this->frame_bytes);
 
-void changePos(float X, float Y, string axis) {
-  int i;
-  for(i=0;i<3;i++) {
-    block[i].status=0;
-    if(block[i].name == axis) {
-      block[i].x=X;
-      block[i].y=Y;
-      block[i].status=1;
-    }
-  }
-  currX=X;
-  currY=Y;
-}
+      // Half a ring of head start before the device gets anything
+      while(this->running && this->decoding && this->ring.available() < PCM_RING_BYTES/2)
+        this_thread::sleep_for(chrono::milliseconds(2));
 
-void createGame() {
-  if(change_level) {
-    block[0].create(0.4, 0.4, 0.8, "z");
-    block[1].create(0.4, 0.8, 0.4, "y");
-    block[2].create(0.8, 0.4, 0.4, "x");
-    changePos(0.4*1, 0.4*1, "z");
-    vert_fall=0;
-    target_mouse_x=0.4*5;
-    target_mouse_y=0.4*5;
-    DYING=0;
-    DYING_inc=0;
-    DYING_rot=3;
-    X_POS=0;
-    X_NEG=0;
-    Y_POS=0;
-    Y_NEG=0;
-    mouse_hit=0;
-    switch (currLevel) {
-      case 1:
-        levels.create_level_1();
-        break;
-      case 2:
-        levels.create_level_2();
-        break;
-      case 3:
-        exit(1);
-        break;
+      while(this->running) {
+        if(!this->ring.read(chunk, size)) {
+          if(!this->decoding)
+            break;
+          memset(chunk, 0, size);
+          this->underruns++;
+        }
+        ao_play(this->dev, (char*)chunk, size);
+      }
     }
-    change_level=0;
-  }
-}
-
-void checkGameStatus(GLFWwindow* window) {
-  int i, j;
-
-  if(DYING_inc>10)
-      change_level=1;
 
-  if(currX>3.9||currX<0||currY>3.9||currY<0) {
-    DYING=1;
-  }
+    void stop() {
+      this->running = 0;
+      if(this->decoder.joinable())
+        this->decoder.join();
+      if(this->player.joinable())
+        this->player.join();
+    }
 
-  for(i=0;i<10;i++) {
-    for(j=0;j<10;j++) {
-      if(!tiles[i][j].status) {
-        if(abs(currX-tiles[i][j].x)<0.3&&abs(currY-tiles[i][j].y)<0.3) {
-          DYING=1;
+    /* clean up */
+    void close() {
+      stop();
+      if(this->opened)
+        printf("audio: %d underruns\n", (int)this->underruns);
+      free(this->buffer);
+      if(this->dev)
+        ao_close(this->dev);
+      if(this->cache_out)
+        abandonCache();
+      if(this->mapping)
+        munmap(this->mapping, this->mapping_bytes);
+      else {
+        if(this->mh) {
+          mpg123_close(this->mh);
+          mpg123_delete(this->mh);
         }
+        mpg123_exit();
       }
+      ao_shutdown();
     }
-  }
+} music;
+
+void stopMusic() {
+  music.stop();
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1830,6 +4510,8 @@ GLFWwindow* initGLFW (int width, int height)
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    if(soak.active())
+      glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
     window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
 
@@ -1863,20 +4545,32 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
-/* Initialize the OpenGL rendering properties *
+/* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
 {
-  int i, j;
+  int i;
+  frame_arena.create("frame", FRAME_ARENA_BYTES);
+  level_arena.create("level", LEVEL_ARENA_BYTES);
+  prefetch_arena.create("prefetch", LEVEL_ARENA_BYTES);
+  tiles.arena = &level_arena;
+  upcoming.arena = &prefetch_arena;
+  gl_objects.create();
+  atexit(reportMemory);
+  // Pick the buffer path before anything is uploaded
+  int phase = startup.begin("static meshes");
+  detectCaps();
+  if(gl_caps.immutable)
+    upload_ring.create();
+
   /* Objects should be created before any other gl function and shaders */
   // Create the models
-  createTriangle(); // Generate the VAO, VBOs, vertices data & copy into the array buffer
+  createStaticMeshes(); // Generate the shared VAO and buffers holding every static mesh
+  startup.end(phase);
 
-  tower_view=1;
-  level_view=0;
-  top_view=0;
-  block_view=0;
-  front_view=0;
+  camera.create(TOWER_VIEW, width, 0.8*height);
+  for(i=0;i<HUD_DIGITS;i++)
+    hud_transforms.add(0, 0, 0);
   total_score=0;
   total_time=0;
 
@@ -1906,14 +4600,49 @@ void initGL (GLFWwindow* window, int width, int height)
   currLevel=1;
 
   updateClock();
+  // The second player starts out with the same camera and axis
+  players[1].save();
+  phase = startup.begin("level build");
   createGame();
+  startup.end(phase);
   
   // Create and compile our GLSL program from the shaders
+  phase = startup.begin("shaders");
   programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
   // Get a handle for our "MVP" uniform
   Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
 
-  
+  // The block shares the fragment shader but animates itself
+  blockProgramID = LoadShaders( "Block_GL.vert", "Sample_GL.frag" );
+  BlockShader.VP = glGetUniformLocation(blockProgramID, "VP");
+  BlockShader.views = glGetUniformLocation(blockProgramID, "views");
+  BlockShader.time = glGetUniformLocation(blockProgramID, "time");
+  BlockShader.position = glGetUniformLocation(blockProgramID, "position");
+  BlockShader.pivot = glGetUniformLocation(blockProgramID, "pivot");
+  BlockShader.pivotBack = glGetUniformLocation(blockProgramID, "pivotBack");
+  BlockShader.rollAxis = glGetUniformLocation(blockProgramID, "rollAxis");
+  BlockShader.rollAngle = glGetUniformLocation(blockProgramID, "rollAngle");
+  BlockShader.rollStart = glGetUniformLocation(blockProgramID, "rollStart");
+  BlockShader.rollDuration = glGetUniformLocation(blockProgramID, "rollDuration");
+  BlockShader.fallStart = glGetUniformLocation(blockProgramID, "fallStart");
+  BlockShader.fallSpeed = glGetUniformLocation(blockProgramID, "fallSpeed");
+  BlockShader.fallAxis = glGetUniformLocation(blockProgramID, "fallAxis");
+  BlockShader.fallSpin = glGetUniformLocation(blockProgramID, "fallSpin");
+
+  // Board chunks draw the switch cross in their fragment shader
+  tileProgramID = LoadShaders( "Tile_GL.vert", "Tile_GL.frag" );
+  TileShader.VP = glGetUniformLocation(tileProgramID, "VP");
+  TileShader.views = glGetUniformLocation(tileProgramID, "views");
+  TileShader.tileSize = glGetUniformLocation(tileProgramID, "tileSize");
+  TileShader.tileTop = glGetUniformLocation(tileProgramID, "tileTop");
+  glUseProgram (tileProgramID);
+  glUniform1f(TileShader.tileSize, 0.4);
+  glUniform1f(TileShader.tileTop, 0.2/2);
+  glUseProgram (programID);
+
+  particles.create();
+  startup.end(phase);
+
   reshapeWindow (window, width, height);
 
     // Background color of the scene
@@ -1933,73 +4662,88 @@ int main (int argc, char** argv)
 {
   int width = 800;
   int height = 600;
+  int frames_in_flight = 2;
+  const char* capture_path = NULL;
+  int capture_frames = 0;
+
+  for(int arg=1;arg<argc;arg++) {
+    if(strcmp(argv[arg], "--bench") == 0) {
+      benchTransforms();
+      return 0;
+    }
+    else if(strcmp(argv[arg], "--frames-in-flight") == 0 && arg+1 < argc) {
+      frames_in_flight = atoi(argv[++arg]);
+    }
+    else if(strcmp(argv[arg], "--capture") == 0 && arg+2 < argc) {
+      capture_path = argv[++arg];
+      capture_frames = atoi(argv[++arg]);
+      // Writes through persistently mapped memory bypass the hooks
+      allow_dsa = 0;
+    }
+    else if(strcmp(argv[arg], "--no-dsa") == 0) {
+      allow_dsa = 0;
+    }
+    else if(strcmp(argv[arg], "--check-allocations") == 0) {
+      frame_allocations.enabled = 1;
+    }
+    else if(strcmp(argv[arg], "--two-player") == 0) {
+      player_count = 2;
+      views.count = 2;
+    }
+    else if(strcmp(argv[arg], "--soak") == 0 && arg+1 < argc) {
+      soak.hours = atof(argv[++arg]);
+    }
+  }
 
-    GLFWwindow* window = initGLFW(width, height);
-
-    mpg123_handle *mh;
-    unsigned char *buffer;
-    size_t buffer_size;
-    size_t done;
-    int err;
-
-    int driver;
-    ao_device *dev;
+    // The music does not need the GL context, it opens while the window,
+    // the shaders and the first level are set up
+    thread audio_init;
+    if(!soak.active())
+      audio_init = thread([] { music.open("doc.mp3"); });
 
-    ao_sample_format format;
-    int channels, encoding;
-    long rate;
+    int phase = startup.begin("window and context");
+    GLFWwindow* window = initGLFW(width, height);
+    startup.end(phase);
+
+    // Headless, so no audio device either
+    if(soak.active()) {
+      initGL (window, width, height);
+      frame_limiter.create(frames_in_flight);
+      int status = soak.run(window);
+      glfwTerminate();
+      return status;
+    }
 
-    /* initializations */
-    ao_initialize();
-    driver = ao_default_driver_id();
-    mpg123_init();
-    mh = mpg123_new(NULL, &err);
-    buffer_size = 2800;
-    buffer = (unsigned char*) malloc(buffer_size * sizeof(unsigned char));
-
-    /* open the file and get the decoding format */
-    mpg123_open(mh, "doc.mp3");
-    mpg123_getformat(mh, &rate, &channels, &encoding);
-
-    /* set the output format and open the output device */
-    format.bits = mpg123_encsize(encoding) * BITS;
-    format.rate = rate;
-    format.channels = channels;
-    format.byte_format = AO_FMT_NATIVE;
-    format.matrix = 0;
-    dev = ao_open_live(driver, &format, NULL);
+    if(capture_path)
+      startCapture(capture_path, capture_frames, width, height);
 
   initGL (window, width, height);
+  frame_limiter.create(frames_in_flight);
+
+  phase = startup.begin("wait for audio");
+  audio_init.join();
+  music.start();
+  startup.end(phase);
 
     double last_update_time = glfwGetTime(), current_time;
+    bool first_frame = 1;
 
     /* Draw in loop */
     while (!glfwWindowShouldClose(window)) {
 
-        // OpenGL Draw commands
-        draw(window, 1);
-        draw(window, 0);
-
-        // Swap Frame Buffer in double buffering
-        glfwSwapBuffers(window);
+        // Block until the GPU is at most frames_in_flight-1 frames behind
+        frame_limiter.wait();
 
-        // Poll for Keyboard and mouse events
+        // Poll for Keyboard and mouse events as late as possible before
+        // the frame that reacts to them is submitted
         glfwPollEvents();
 
         glfwGetCursorPos(window, &mouse_xpos, &mouse_ypos);
 
         glfwSetScrollCallback(window, scroll_callback);
 
-        /* decode and play */
-        if (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK)
-
-            ao_play(dev, (char*)buffer, done);
-        else mpg123_seek(mh, 0, SEEK_SET); // loop audio from start again if ended
-
-        checkGameStatus(window);
-        updateGameStatus();
-        getCurrIndex();
-        createGame();
+        frame_allocations.begin();
+        stepGame(window);
 
         // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
         current_time = glfwGetTime(); // Time in seconds
@@ -2007,17 +4751,23 @@ int main (int argc, char** argv)
         if ((current_time - last_update_time) >= 1.0) { // atleast 0.5s elapsed since last frame
             // do something every 0.5 seconds ..
             updateClock();
+            reportOverdraw();
             last_update_time = current_time;
         }
+
+        if(first_frame)
+          phase = startup.begin("first frame");
+        renderFrame(window);
+        frame_allocations.end();
+        if(first_frame) {
+          glFinish();
+          startup.end(phase);
+          startup.report();
+          first_frame = 0;
+        }
     }
 
-        /* clean up */
-    free(buffer);
-    ao_close(dev);
-    mpg123_close(mh);
-    mpg123_delete(mh);
-    mpg123_exit();
-    ao_shutdown();
+    music.close();
 
     glfwTerminate();
 //    exit(EXIT_SUCCESS);
@@ -0,0 +1,91 @@
+/* Binary format of a GL command capture, shared by the game (--capture)
+   and the standalone replayer.
+
+   The file starts with a GLCaptureHeader, followed by one record per GL
+   call: a 16 bit opcode and its arguments in call order. Integers and
+   enums are 32 bit, offsets, sync handles and timeouts 64 bit, floats
+   32 bit. Payloads (buffer data, uniform arrays, strings) are a 32 bit
+   byte count followed by the bytes. Object names are the ones the capturing driver
+   returned, the replayer maps them to its own. */
+#ifndef GLCAPTURE_H
+#define GLCAPTURE_H
+
+#include <stdint.h>
+
+#define GLCAPTURE_MAGIC 0x50434c47   // "GLCP"
+#define GLCAPTURE_VERSION 1
+
+struct GLCaptureHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+};
+
+enum GLCaptureOp {
+  CAP_FRAME,                      // end of a frame, the game swapped buffers
+
+  // Shaders and programs
+  CAP_CREATE_SHADER,              // type, name
+  CAP_SHADER_SOURCE,              // shader, source payload
+  CAP_COMPILE_SHADER,             // shader
+  CAP_DELETE_SHADER,              // shader
+  CAP_CREATE_PROGRAM,             // name
+  CAP_ATTACH_SHADER,              // program, shader
+  CAP_TRANSFORM_FEEDBACK_VARYINGS,// program, count, buffer mode, count name payloads
+  CAP_LINK_PROGRAM,               // program
+  CAP_USE_PROGRAM,                // program
+  CAP_GET_UNIFORM_LOCATION,       // program, location, name payload
+
+  // Uniforms of the current program
+  CAP_UNIFORM_1F,                 // location, x
+  CAP_UNIFORM_3F,                 // location, x, y, z
+  CAP_UNIFORM_1I,                 // location, x
+  CAP_UNIFORM_1FV,                // location, count, payload
+  CAP_UNIFORM_3FV,                // location, count, payload
+  CAP_UNIFORM_1IV,                // location, count, payload
+  CAP_UNIFORM_MATRIX_4FV,         // location, count, transpose, payload
+
+  // Buffers and vertex arrays
+  CAP_GEN_BUFFERS,                // n, names
+  CAP_DELETE_BUFFERS,             // n, names
+  CAP_BIND_BUFFER,                // target, buffer
+  CAP_BIND_BUFFER_BASE,           // target, index, buffer
+  CAP_BUFFER_DATA,                // target, usage, size, has data, payload
+  CAP_GEN_VERTEX_ARRAYS,          // n, names
+  CAP_DELETE_VERTEX_ARRAYS,       // n, names
+  CAP_BIND_VERTEX_ARRAY,          // array
+  CAP_ENABLE_VERTEX_ATTRIB_ARRAY, // index
+  CAP_VERTEX_ATTRIB_POINTER,      // index, size, type, normalized, stride, offset
+
+  // Fixed function state
+  CAP_ENABLE,                     // cap
+  CAP_DISABLE,                    // cap
+  CAP_CLEAR_COLOR,                // r, g, b, a
+  CAP_CLEAR_DEPTH,                // depth
+  CAP_CLEAR,                      // mask
+  CAP_VIEWPORT,                   // x, y, width, height
+  CAP_POLYGON_MODE,               // face, mode
+  CAP_DEPTH_FUNC,                 // func
+
+  // Draws
+  CAP_DRAW_ARRAYS,                // mode, first, count
+  CAP_DRAW_ARRAYS_INSTANCED,      // mode, first, count, instances
+  CAP_DRAW_ELEMENTS_INSTANCED_BASE_VERTEX, // mode, count, type, offset, instances, base vertex
+  CAP_BEGIN_TRANSFORM_FEEDBACK,   // mode
+  CAP_END_TRANSFORM_FEEDBACK,
+
+  // Synchronization and queries
+  CAP_FENCE_SYNC,                 // sync
+  CAP_CLIENT_WAIT_SYNC,           // sync, flags, timeout
+  CAP_DELETE_SYNC,                // sync
+  CAP_GEN_QUERIES,                // n, names
+  CAP_BEGIN_QUERY,                // target, query
+  CAP_END_QUERY,                  // target
+
+  // Buffer and vertex array updates
+  CAP_BUFFER_SUB_DATA,            // target, offset, payload
+  CAP_DISABLE_VERTEX_ATTRIB_ARRAY,// index
+};
+
+#endif
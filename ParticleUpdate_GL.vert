@@ -0,0 +1,67 @@
+#version 330 core
+
+// One vertex per particle, written back through transform feedback
+layout (location = 0) in vec3 particlePosition;
+layout (location = 1) in vec3 particleVelocity;
+layout (location = 2) in vec3 particleColor;
+layout (location = 3) in float particleLife;   // seconds left, dead at <= 0
+
+uniform float dt;
+uniform float gravity;
+uniform float seed;
+uniform int capacity;
+
+// Bursts spawned this step, each overwrites the particle slots
+// [burstFirst, burstFirst+burstSize) of the ring
+#define MAX_BURSTS 4
+uniform int burstCount;
+uniform int burstFirst[MAX_BURSTS];
+uniform int burstSize[MAX_BURSTS];
+uniform vec3 burstOrigin[MAX_BURSTS];
+uniform vec3 burstExtent[MAX_BURSTS];   // particles start anywhere in this box
+uniform vec3 burstColor[MAX_BURSTS];
+uniform float burstSpeed[MAX_BURSTS];
+uniform float burstLife;
+
+out vec3 outPosition;
+out vec3 outVelocity;
+out vec3 outColor;
+out float outLife;
+
+float hash (float n)
+{
+    return fract(sin(n) * 43758.5453);
+}
+
+void main ()
+{
+    vec3 position = particlePosition;
+    vec3 velocity = particleVelocity;
+    vec3 color = particleColor;
+    float life = particleLife;
+
+    for (int i = 0; i < burstCount; i++) {
+        int slot = (gl_VertexID - burstFirst[i] + capacity) % capacity;
+        if (slot < burstSize[i]) {
+            float n = float(gl_VertexID) * 1.618 + seed;
+            vec3 jitter = vec3(hash(n), hash(n + 1.7), hash(n + 3.1)) - 0.5;
+            // Mostly sideways and up, the debris falls back under gravity
+            vec3 direction = normalize(vec3(hash(n + 5.3) - 0.5, hash(n + 7.9) - 0.5, hash(n + 11.1) + 0.2));
+            position = burstOrigin[i] + jitter * burstExtent[i];
+            velocity = direction * burstSpeed[i] * (0.3 + 0.7 * hash(n + 13.7));
+            color = burstColor[i] * (0.5 + 0.5 * hash(n + 17.3));
+            life = burstLife * (0.5 + 0.5 * hash(n + 19.9));
+        }
+    }
+
+    if (life > 0.0) {
+        velocity.z -= gravity * dt;
+        position += velocity * dt;
+        life -= dt;
+    }
+
+    outPosition = position;
+    outVelocity = velocity;
+    outColor = color;
+    outLife = life;
+}
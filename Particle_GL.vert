@@ -0,0 +1,40 @@
+#version 330 core
+
+// input data : the particle buffer last written by ParticleUpdate_GL.vert
+layout (location = 0) in vec3 particlePosition;
+layout (location = 2) in vec3 particleColor;
+layout (location = 3) in float particleLife;
+
+// One instance per view, split screen squeezes each into its half
+uniform mat4 VP[2];
+uniform int views;
+uniform float pointScale;   // pixels covered by one world unit at w = 1
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+vec4 viewPosition (vec3 world)
+{
+    vec4 clip = VP[gl_InstanceID] * vec4(world, 1);
+    gl_ClipDistance[0] = clip.w + clip.x;
+    gl_ClipDistance[1] = clip.w - clip.x;
+    if (views > 1)
+        clip.x = 0.5 * clip.x + (gl_InstanceID == 0 ? -0.5 : 0.5) * clip.w;
+    return clip;
+}
+
+void main ()
+{
+    fragColor = particleColor;
+
+    if (particleLife <= 0.0) {
+        // Outside the clip volume, the point is dropped before rasterization
+        gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+        gl_ClipDistance[0] = gl_ClipDistance[1] = -1.0;
+        gl_PointSize = 1.0;
+        return;
+    }
+
+    gl_Position = viewPosition(particlePosition);
+    gl_PointSize = max(1.0, pointScale / gl_Position.w);
+}
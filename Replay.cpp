@@ -0,0 +1,520 @@
+/* Re-issues a GL command capture recorded with ./sample2D --capture as fast
+   as the driver takes it, without input, audio or game logic in the way.
+
+   ./replay capture.bin [repeat]
+
+   Everything before the first frame (shaders, buffers, the first level) is
+   replayed once, the captured frames are then replayed repeat times. */
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "GLCapture.h"
+
+using namespace std;
+
+/* Reads never go past end. A read that would sets truncated, skips to
+   the end and returns zeros or an empty payload, which GL takes without
+   touching memory, so a record cut short is harmless to finish. An
+   unknown opcode marks the capture truncated as well. */
+class CaptureReader {
+  public:
+    const char* at;
+    const char* end;
+    bool truncated;
+
+    bool done() {
+      return this->at >= this->end;
+    }
+
+    size_t remaining() {
+      return this->end - this->at;
+    }
+
+    void fail() {
+      this->truncated = true;
+      this->at = this->end;
+    }
+
+    void read(void* value, size_t size) {
+      if(size > remaining()) {
+        fail();
+        memset(value, 0, size);
+        return;
+      }
+      memcpy(value, this->at, size);
+      this->at += size;
+    }
+
+    uint16_t op() {
+      uint16_t value;
+      read(&value, sizeof(value));
+      return value;
+    }
+
+    uint32_t u32() {
+      uint32_t value;
+      read(&value, sizeof(value));
+      return value;
+    }
+
+    uint64_t u64() {
+      uint64_t value;
+      read(&value, sizeof(value));
+      return value;
+    }
+
+    float f32() {
+      float value;
+      read(&value, sizeof(value));
+      return value;
+    }
+
+    const char* payload(uint32_t& size) {
+      size = u32();
+      if(size > remaining()) {
+        fail();
+        size = 0;
+      }
+      const char* data = this->at;
+      this->at += size;
+      return data;
+    }
+
+    /* Element count of a uniform array, no more than its payload holds */
+    GLsizei elements(uint32_t count, uint32_t size, size_t element) {
+      return min<size_t>(count, size/element);
+    }
+};
+
+/* Captured object names to the ones this driver hands out */
+class NameMap {
+  public:
+    map<GLuint, GLuint> names;
+
+    GLuint operator[](GLuint captured) {
+      map<GLuint, GLuint>::iterator found = this->names.find(captured);
+      return found != this->names.end() ? found->second : 0;
+    }
+
+    bool has(GLuint captured) {
+      return (*this)[captured] != 0;
+    }
+
+    void add(GLuint captured, GLuint name) {
+      this->names[captured] = name;
+    }
+
+    void remove(GLuint captured) {
+      this->names.erase(captured);
+    }
+};
+
+NameMap shaders, programs, buffers, vertex_arrays, queries;
+map<uint64_t, GLsync> syncs;
+map<pair<GLuint, GLint>, GLint> locations;   // (captured program, captured location)
+GLuint current_program;
+
+GLint location(GLint captured) {
+  if(captured < 0)
+    return captured;
+  return locations[make_pair(current_program, captured)];
+}
+
+/* Names still alive from an earlier pass over the frames are kept, so
+   repeating the frames doesn't create (and leak) a new object each time */
+void genNames(CaptureReader& in, NameMap& map, void (APIENTRY *gen)(GLsizei, GLuint*)) {
+  uint32_t n = in.u32();
+  if(n > in.remaining()/sizeof(uint32_t)) {
+    in.fail();
+    return;
+  }
+  for(uint32_t i=0;i<n;i++) {
+    GLuint captured = in.u32(), name;
+    if(map.has(captured))
+      continue;
+    gen(1, &name);
+    map.add(captured, name);
+  }
+}
+
+void deleteNames(CaptureReader& in, NameMap& map, void (APIENTRY *del)(GLsizei, const GLuint*)) {
+  uint32_t n = in.u32();
+  if(n > in.remaining()/sizeof(uint32_t)) {
+    in.fail();
+    return;
+  }
+  vector<GLuint> names(n);
+  for(uint32_t i=0;i<n;i++) {
+    GLuint captured = in.u32();
+    names[i] = map[captured];
+    map.remove(captured);
+  }
+  del(n, names.data());
+}
+
+/* Runs commands until the end of the next frame, returns false at the end
+   of the file or when the capture turns out truncated */
+bool replayFrame(CaptureReader& in, GLFWwindow* window) {
+  uint32_t size;
+  const char* data;
+
+  while(!in.done()) {
+    uint16_t op = in.op();
+    switch(op) {
+      case CAP_FRAME:
+        glfwSwapBuffers(window);
+        glfwPollEvents();
+        return true;
+
+      case CAP_CREATE_SHADER: {
+        GLenum type = in.u32();
+        shaders.add(in.u32(), glCreateShader(type));
+        break;
+      }
+      case CAP_SHADER_SOURCE: {
+        GLuint shader = shaders[in.u32()];
+        data = in.payload(size);
+        GLint length = size;
+        glShaderSource(shader, 1, &data, &length);
+        break;
+      }
+      case CAP_COMPILE_SHADER:
+        glCompileShader(shaders[in.u32()]);
+        break;
+      case CAP_DELETE_SHADER:
+        glDeleteShader(shaders[in.u32()]);
+        break;
+      case CAP_CREATE_PROGRAM:
+        programs.add(in.u32(), glCreateProgram());
+        break;
+      case CAP_ATTACH_SHADER: {
+        GLuint program = programs[in.u32()];
+        glAttachShader(program, shaders[in.u32()]);
+        break;
+      }
+      case CAP_TRANSFORM_FEEDBACK_VARYINGS: {
+        GLuint program = programs[in.u32()];
+        uint32_t count = in.u32();
+        GLenum mode = in.u32();
+        if(count > in.remaining()/sizeof(uint32_t)) {
+          in.fail();
+          break;
+        }
+        vector<string> names(count);
+        vector<const GLchar*> varyings(count);
+        for(uint32_t i=0;i<count;i++) {
+          data = in.payload(size);
+          names[i].assign(data, size);
+          varyings[i] = names[i].c_str();
+        }
+        glTransformFeedbackVaryings(program, count, varyings.data(), mode);
+        break;
+      }
+      case CAP_LINK_PROGRAM:
+        glLinkProgram(programs[in.u32()]);
+        break;
+      case CAP_USE_PROGRAM:
+        current_program = in.u32();
+        glUseProgram(programs[current_program]);
+        break;
+      case CAP_GET_UNIFORM_LOCATION: {
+        GLuint program = in.u32();
+        GLint captured = in.u32();
+        data = in.payload(size);
+        string name(data, size);
+        locations[make_pair(program, captured)] = glGetUniformLocation(programs[program], name.c_str());
+        break;
+      }
+
+      case CAP_UNIFORM_1F: {
+        GLint at = location(in.u32());
+        glUniform1f(at, in.f32());
+        break;
+      }
+      case CAP_UNIFORM_3F: {
+        GLint at = location(in.u32());
+        float x = in.f32(), y = in.f32(), z = in.f32();
+        glUniform3f(at, x, y, z);
+        break;
+      }
+      case CAP_UNIFORM_1I: {
+        GLint at = location(in.u32());
+        glUniform1i(at, in.u32());
+        break;
+      }
+      case CAP_UNIFORM_1FV: {
+        GLint at = location(in.u32());
+        uint32_t count = in.u32();
+        data = in.payload(size);
+        glUniform1fv(at, in.elements(count, size, sizeof(GLfloat)), (const GLfloat*)data);
+        break;
+      }
+      case CAP_UNIFORM_3FV: {
+        GLint at = location(in.u32());
+        uint32_t count = in.u32();
+        data = in.payload(size);
+        glUniform3fv(at, in.elements(count, size, 3*sizeof(GLfloat)), (const GLfloat*)data);
+        break;
+      }
+      case CAP_UNIFORM_1IV: {
+        GLint at = location(in.u32());
+        uint32_t count = in.u32();
+        data = in.payload(size);
+        glUniform1iv(at, in.elements(count, size, sizeof(GLint)), (const GLint*)data);
+        break;
+      }
+      case CAP_UNIFORM_MATRIX_4FV: {
+        GLint at = location(in.u32());
+        uint32_t count = in.u32();
+        GLboolean transpose = in.u32();
+        data = in.payload(size);
+        glUniformMatrix4fv(at, in.elements(count, size, 16*sizeof(GLfloat)), transpose, (const GLfloat*)data);
+        break;
+      }
+
+      case CAP_GEN_BUFFERS:
+        genNames(in, buffers, glGenBuffers);
+        break;
+      case CAP_DELETE_BUFFERS:
+        deleteNames(in, buffers, glDeleteBuffers);
+        break;
+      case CAP_BIND_BUFFER: {
+        GLenum target = in.u32();
+        glBindBuffer(target, buffers[in.u32()]);
+        break;
+      }
+      case CAP_BIND_BUFFER_BASE: {
+        GLenum target = in.u32();
+        GLuint index = in.u32();
+        glBindBufferBase(target, index, buffers[in.u32()]);
+        break;
+      }
+      case CAP_BUFFER_DATA: {
+        GLenum target = in.u32();
+        GLenum usage = in.u32();
+        GLsizeiptr bytes = in.u32();
+        bool has_data = in.u32();
+        data = in.payload(size);
+        if(has_data)
+          glBufferData(target, size, data, usage);
+        else
+          glBufferData(target, bytes, NULL, usage);
+        break;
+      }
+      case CAP_GEN_VERTEX_ARRAYS:
+        genNames(in, vertex_arrays, glGenVertexArrays);
+        break;
+      case CAP_DELETE_VERTEX_ARRAYS:
+        deleteNames(in, vertex_arrays, glDeleteVertexArrays);
+        break;
+      case CAP_BIND_VERTEX_ARRAY:
+        glBindVertexArray(vertex_arrays[in.u32()]);
+        break;
+      case CAP_ENABLE_VERTEX_ATTRIB_ARRAY:
+        glEnableVertexAttribArray(in.u32());
+        break;
+      case CAP_VERTEX_ATTRIB_POINTER: {
+        GLuint index = in.u32();
+        GLint components = in.u32();
+        GLenum type = in.u32();
+        GLboolean normalized = in.u32();
+        GLsizei stride = in.u32();
+        uintptr_t offset = in.u64();
+        glVertexAttribPointer(index, components, type, normalized, stride, (void*)offset);
+        break;
+      }
+
+      case CAP_ENABLE:
+        glEnable(in.u32());
+        break;
+      case CAP_DISABLE:
+        glDisable(in.u32());
+        break;
+      case CAP_CLEAR_COLOR: {
+        float r = in.f32(), g = in.f32(), b = in.f32(), a = in.f32();
+        glClearColor(r, g, b, a);
+        break;
+      }
+      case CAP_CLEAR_DEPTH:
+        glClearDepth(in.f32());
+        break;
+      case CAP_CLEAR:
+        glClear(in.u32());
+        break;
+      case CAP_VIEWPORT: {
+        GLint x = in.u32(), y = in.u32();
+        GLsizei width = in.u32(), height = in.u32();
+        glViewport(x, y, width, height);
+        break;
+      }
+      case CAP_POLYGON_MODE: {
+        GLenum face = in.u32();
+        glPolygonMode(face, in.u32());
+        break;
+      }
+      case CAP_DEPTH_FUNC:
+        glDepthFunc(in.u32());
+        break;
+
+      case CAP_DRAW_ARRAYS: {
+        GLenum mode = in.u32();
+        GLint first = in.u32();
+        glDrawArrays(mode, first, in.u32());
+        break;
+      }
+      case CAP_DRAW_ARRAYS_INSTANCED: {
+        GLenum mode = in.u32();
+        GLint first = in.u32();
+        GLsizei count = in.u32();
+        glDrawArraysInstanced(mode, first, count, in.u32());
+        break;
+      }
+      case CAP_DRAW_ELEMENTS_INSTANCED_BASE_VERTEX: {
+        GLenum mode = in.u32();
+        GLsizei count = in.u32();
+        GLenum type = in.u32();
+        uintptr_t offset = in.u64();
+        GLsizei instances = in.u32();
+        GLint base_vertex = in.u32();
+        glDrawElementsInstancedBaseVertex(mode, count, type, (void*)offset, instances, base_vertex);
+        break;
+      }
+      case CAP_BEGIN_TRANSFORM_FEEDBACK:
+        glBeginTransformFeedback(in.u32());
+        break;
+      case CAP_END_TRANSFORM_FEEDBACK:
+        glEndTransformFeedback();
+        break;
+
+      case CAP_FENCE_SYNC: {
+        // A fence left over from the previous pass over the frames
+        uint64_t sync = in.u64();
+        if(syncs.count(sync))
+          glDeleteSync(syncs[sync]);
+        syncs[sync] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        break;
+      }
+      case CAP_CLIENT_WAIT_SYNC: {
+        uint64_t sync = in.u64();
+        GLbitfield flags = in.u32();
+        GLuint64 timeout = in.u64();
+        if(syncs.count(sync))
+          glClientWaitSync(syncs[sync], flags, timeout);
+        break;
+      }
+      case CAP_DELETE_SYNC: {
+        uint64_t sync = in.u64();
+        if(syncs.count(sync)) {
+          glDeleteSync(syncs[sync]);
+          syncs.erase(sync);
+        }
+        break;
+      }
+      case CAP_GEN_QUERIES:
+        genNames(in, queries, glGenQueries);
+        break;
+      case CAP_BEGIN_QUERY: {
+        GLenum target = in.u32();
+        glBeginQuery(target, queries[in.u32()]);
+        break;
+      }
+      case CAP_END_QUERY:
+        glEndQuery(in.u32());
+        break;
+
+      case CAP_BUFFER_SUB_DATA: {
+        GLenum target = in.u32();
+        GLintptr offset = in.u64();
+        data = in.payload(size);
+        glBufferSubData(target, offset, size, data);
+        break;
+      }
+      case CAP_DISABLE_VERTEX_ATTRIB_ARRAY:
+        glDisableVertexAttribArray(in.u32());
+        break;
+
+      default:
+        fprintf(stderr, "Unknown capture opcode %d\n", op);
+        in.fail();
+        return false;
+    }
+    if(in.truncated) {
+      fprintf(stderr, "Capture is truncated or corrupt, a record of opcode %d runs past the end\n", op);
+      return false;
+    }
+  }
+  return false;
+}
+
+int main (int argc, char** argv)
+{
+  if(argc < 2) {
+    fprintf(stderr, "usage: %s capture.bin [repeat]\n", argv[0]);
+    return 1;
+  }
+  int repeat = argc > 2 ? atoi(argv[2]) : 1;
+
+  // The whole capture is loaded up front so file reads are not timed
+  ifstream file(argv[1], ios::binary);
+  vector<char> bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  GLCaptureHeader header;
+  if(bytes.size() < sizeof(header)) {
+    fprintf(stderr, "Cannot read %s\n", argv[1]);
+    return 1;
+  }
+  memcpy(&header, bytes.data(), sizeof(header));
+  if(header.magic != GLCAPTURE_MAGIC || header.version != GLCAPTURE_VERSION) {
+    fprintf(stderr, "%s is not a version %d GL capture\n", argv[1], GLCAPTURE_VERSION);
+    return 1;
+  }
+
+  if(!glfwInit())
+    return 1;
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  GLFWwindow* window = glfwCreateWindow(header.width, header.height, "Replay", NULL, NULL);
+  if(!window) {
+    glfwTerminate();
+    return 1;
+  }
+  glfwMakeContextCurrent(window);
+  gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+  // Not tied to the display refresh, frames go out as fast as they are done
+  glfwSwapInterval(0);
+
+  CaptureReader in = {bytes.data()+sizeof(header), bytes.data()+bytes.size(), false};
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  replayFrame(in, window);
+  glFinish();
+  double setup_ms = chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
+
+  const char* first_frame = in.at;
+  int frames=0;
+  start = chrono::steady_clock::now();
+  for(int r=0;r<repeat && !in.truncated;r++) {
+    in.at = first_frame;
+    while(replayFrame(in, window))
+      frames++;
+  }
+  glFinish();
+  double frames_ms = chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
+
+  printf("setup and first frame: %.2f ms\n", setup_ms);
+  if(frames)
+    printf("%d frames: %.3f ms per frame (%.1f fps)\n", frames, frames_ms/frames, 1000.0*frames/frames_ms);
+
+  glfwDestroyWindow(window);
+  glfwTerminate();
+  return in.truncated ? 1 : 0;
+}
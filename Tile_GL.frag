@@ -0,0 +1,25 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec3 fragColor;
+in vec3 worldPosition;
+in float isSwitch;
+
+uniform float tileSize;
+uniform float tileTop;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    color = fragColor;
+
+    // Switch tiles get a white cross on their top face, drawn from the
+    // position inside the tile so it needs no geometry of its own
+    if (isSwitch > 0.5 && worldPosition.z > tileTop - 0.0001) {
+        vec2 cell = fract(worldPosition.xy / tileSize + 0.5) - 0.5;
+        if (abs(cell.x - cell.y) < 0.1 || abs(cell.x + cell.y) < 0.1)
+            color = vec3(1, 1, 1);
+    }
+}
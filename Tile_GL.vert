@@ -0,0 +1,35 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+layout (location = 2) in float vertexSwitch;
+
+// One instance per view, split screen squeezes each into its half
+uniform mat4 VP[2];
+uniform int views;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+out vec3 worldPosition;
+out float isSwitch;
+
+vec4 viewPosition (vec3 world)
+{
+    vec4 clip = VP[gl_InstanceID] * vec4(world, 1);
+    gl_ClipDistance[0] = clip.w + clip.x;
+    gl_ClipDistance[1] = clip.w - clip.x;
+    if (views > 1)
+        clip.x = 0.5 * clip.x + (gl_InstanceID == 0 ? -0.5 : 0.5) * clip.w;
+    return clip;
+}
+
+void main ()
+{
+    // Board chunks are baked in world space
+    fragColor = vertexColor;
+    worldPosition = vertexPosition;
+    isSwitch = vertexSwitch;
+
+    gl_Position = viewPosition(vertexPosition);
+}